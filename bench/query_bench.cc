@@ -0,0 +1,111 @@
+// Measures queries with a fresh query state per query against queries that
+// reuse a thread's AnnoyQueryContext, counting heap allocations.
+//
+//   make bench && ./priv/query_bench [items] [dimensions] [queries]
+
+#include "annoylib.h"
+#include "kissrandom.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+using namespace Annoy;
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+typedef AnnoyIndex<int32_t, float, Angular, Kiss64Random, AnnoyIndexSingleThreadedBuildPolicy> Index;
+
+static void report(const char* name, double seconds, size_t allocs, int queries) {
+  printf("%-8s %8.2f us/query %8.2f allocations/query\n",
+         name, 1e6 * seconds / queries, (double)allocs / queries);
+}
+
+int main(int argc, char** argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 20000;
+  int f = argc > 2 ? atoi(argv[2]) : 64;
+  int queries = argc > 3 ? atoi(argv[3]) : 20000;
+
+  std::mt19937 generator(1);
+  std::normal_distribution<float> normal;
+  vector<float> v(f);
+
+  Index index(f);
+  for (int i = 0; i < n; i++) {
+    for (int z = 0; z < f; z++)
+      v[z] = normal(generator);
+    index.add_item(i, &v[0]);
+  }
+  index.build(10);
+
+  vector<vector<float> > vectors(queries, vector<float>(f));
+  for (int q = 0; q < queries; q++)
+    for (int z = 0; z < f; z++)
+      vectors[q][z] = normal(generator);
+
+  for (int pass = 0; pass < 2; pass++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t before = allocations;
+
+    for (int q = 0; q < queries; q++) {
+      AnnoyQueryState<int32_t, float> state;
+      vector<int32_t> result;
+      vector<float> distances;
+      index.query_begin_by_vector(&state, &vectors[q][0], 10, -1);
+      index.query_advance(&state, (size_t)-1);
+      index.query_finish(&state, &result, &distances);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (pass)
+      report("fresh", elapsed.count(), allocations - before, queries);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t before = allocations;
+
+    for (int q = 0; q < queries; q++) {
+      AnnoyQueryContext<int32_t, float>& context = AnnoyQueryContext<int32_t, float>::local();
+      AnnoyQueryState<int32_t, float>* state = context.reuse();
+      index.query_begin_by_vector(state, &vectors[q][0], 10, -1);
+      index.query_advance(state, (size_t)-1);
+      index.query_finish(state, &context.result, &context.distances);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (pass)
+      report("reused", elapsed.count(), allocations - before, queries);
+  }
+
+  return 0;
+}
@@ -20,16 +20,35 @@ defmodule AnnoyEx do
     * `:euclidean`
     * `:manhattan`
     * `:dot`
+
+    Options:
+    * `:dtype` - `:float32`, the default, `:float16` or `:bfloat16`.  A 16 bit index
+      takes float vectors and builds in float32 like any other, but `save/3` writes it
+      with 16 bit elements, about half the size, and `load/3` maps such files.  Queries
+      convert the elements to float32 as they go and accumulate in float32, reading half
+      the memory.  `float16` keeps more precision, `bfloat16` the full float32 range.
+      These indexes can't be built on disk, see `on_disk_build/2`.
   """
   @spec new(f :: pos_integer()) :: {:ok, reference()}
   @spec new(f :: pos_integer(), metric :: atom()) :: {:ok, reference()}
-  def new(f, metric \\ :angular)
+  @spec new(f :: pos_integer(), metric :: atom(), opts :: keyword()) :: {:ok, reference()}
+  def new(f, metric \\ :angular, opts \\ [])
 
-  def new(_, _) do
+  def new(_, _, _) do
     exit(:nif_library_not_loaded)
   end
 
-  @doc "Loads (mmaps) an index from disk.  Full path must be given."
+  @doc ~S"""
+  Loads (mmaps) an index from disk.  Full path must be given.  Runs on a dirty IO scheduler.
+
+  The file is loaded into a new index which then replaces the current one, see `swap/3`.
+  If loading fails the current index is left as it was.
+
+  Indexes loaded from the same file, with the same metric and number of dimensions, share
+  one mapping across all handles in the VM, so loading a file that is already loaded is
+  cheap.  The mapping goes away with the last handle using it.  A file that was rewritten
+  since it was loaded is mapped afresh.
+  """
   @spec load(idx :: reference(), filename :: binary()) :: ok_or_err_tuple()
   @spec load(idx :: reference(), filename :: binary(), preload :: boolean()) :: ok_or_err_tuple()
   def load(idx, filename, preload \\ false)
@@ -38,7 +57,12 @@ defmodule AnnoyEx do
     exit(:nif_library_not_loaded)
   end
 
-  @doc "Unloads."
+  @doc ~S"""
+  Unloads.
+
+  The index is replaced by an empty one; queries still running against the old index
+  finish first, and it is unmapped after the last of them is done.
+  """
   @spec unload(idx :: reference()) :: :ok
   def unload(idx)
 
@@ -46,7 +70,39 @@ defmodule AnnoyEx do
     exit(:nif_library_not_loaded)
   end
 
-  @doc "Saves the index to disk.  Full path must be given."
+  @doc ~S"""
+  Atomically replaces the index in `idx` with the one in `filename`, without pausing queries.
+
+  Queries that are running when the swap happens finish against the old index, which is
+  unmapped once the last of them is done, so memory for both indexes is only needed
+  briefly.  New queries see the new index as soon as `swap/3` returns `:ok`.  On error the
+  old index stays in place.  Same as `load/3`.
+
+  Calls reading the index (queries, `get_item_vector/2`, ...) run concurrently with each
+  other.  Calls that change the index in place (`add_item/3`, `build/3`, `save/3`, ...) wait
+  for them and make them wait.  A call that would wait never blocks a normal scheduler, nor
+  takes a dirty IO scheduler from file operations: it yields and tries again each time its
+  process is scheduled, so a long build or save does not hold up other processes.  The
+  waiting process stays runnable meanwhile, so thousands of queries waiting for a build
+  cost scheduler time; keep queries off an index while it is rebuilt, eg. by building a
+  new one and using `swap/3`.
+  """
+  @spec swap(idx :: reference(), filename :: binary()) :: ok_or_err_tuple()
+  @spec swap(idx :: reference(), filename :: binary(), prefault :: boolean()) :: ok_or_err_tuple()
+  def swap(idx, filename, prefault \\ false)
+
+  def swap(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Saves the index to disk.  Full path must be given.  Runs on a dirty IO scheduler.
+
+  A built index is then loaded from the saved file.  A loaded index only writes the file
+  and keeps its current mapping, which may be shared with other handles.
+
+  The trees are written in page sized blocks, see `get_layout/1`.
+  """
   @spec save(idx :: reference(), filename :: binary()) :: ok_or_err_tuple()
   @spec save(idx :: reference(), filename :: binary(), prefault :: boolean()) :: ok_or_err_tuple()
   def save(idx, filename, prefault \\ false)
@@ -55,6 +111,63 @@ defmodule AnnoyEx do
     exit(:nif_library_not_loaded)
   end
 
+  @doc ~S"""
+  Saves a built index to disk with its item vectors and split planes quantized to int8,
+  about a quarter of the size of `save/3` for large `f`.  Runs on a dirty IO scheduler.
+
+  Each vector is stored as 8 bit codes with a scale and offset of its own.  Queries
+  compare the float query against the codes directly, so results are close to those of
+  the float index but not the same.
+
+  Options:
+
+  * `:vectors` - also write the float item vectors to this file, for `load_quantized/3`
+    to rerank with.
+  * `:dtype` - how vectors are stored: `:int8` (the default), `:float16`, `:bfloat16` or
+    `:float32`.  With `:float32` nothing is lost and results are those of the float index;
+    only the layout changes.  The nodes, 16 bytes each, sit together apart from the
+    vectors, and leaf lists take 4 bytes per item instead of a node of their own, so the
+    parts walked by queries stay small.  For `f` of 32 and more the file is a little
+    smaller than with `save/3`.
+  * `:pq` - product quantize the items instead, into this many bytes each, which must
+    divide `f`.  Each item is split into `pq` subvectors, and each subvector is stored as
+    the closest of 256 centroids, trained by k-means on a sample of the items.  Split
+    planes are then stored as float16.  Scores are coarse, so this is meant to be used
+    with `:vectors` and reranking; with angular, `get_item_vector/2` gives unit vectors
+    unless the float vectors are loaded.  Training is seeded by `set_seed/2`.
+  """
+  @spec save_quantized(idx :: reference(), filename :: binary(), opts :: keyword()) ::
+          ok_or_err_tuple()
+  def save_quantized(idx, filename, opts \\ [])
+
+  def save_quantized(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Loads (mmaps) an index written by `save_quantized/3`, replacing the current one like
+  `swap/3`.  Runs on a dirty IO scheduler.
+
+  The quantized index can be queried but not changed.  It is not shared with other handles
+  the way `load/3` shares indexes.  Any file written by `save_quantized/3`, or by `save/3`
+  with a 16 bit `:dtype`, can be loaded.
+
+  Options:
+
+  * `:vectors` - the float vectors written by `save_quantized/3`.  When given, the
+    `n * rerank` best candidates of each query are rescored with them, so the distances
+    returned are exact, and `get_item_vector/2` returns the original vectors.
+  * `:rerank` - defaults to `4`.
+  * `:prefault` - defaults to `false`, see `load/3`.
+  """
+  @spec load_quantized(idx :: reference(), filename :: binary(), opts :: keyword()) ::
+          ok_or_err_tuple()
+  def load_quantized(idx, filename, opts \\ [])
+
+  def load_quantized(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
   @doc ~S"""
   Returns the `n` closest items to the item at position `i`.
   During the query it will inspect up to `search_k` nodes,
@@ -62,36 +175,129 @@ defmodule AnnoyEx do
   `search_k` gives you a run-time tradeoff between better accuracy and speed.
   If you set include_distances to `true`.
 
+  Queries run on the calling process' scheduler.  A query that outlasts its time slice,
+  eg. because of a very large `search_k`, yields and is resumed where it left off rather
+  than blocking the scheduler.
+
   Returns a 2 element tuple with two lists in it: results and distances.
+
+  Options:
+  * `:format` - `:list` (the default) or `:packed`.  With `:packed` the tuple holds two
+    binaries instead: the results as native-endian int32s and the distances as
+    native-endian float32s, which is much cheaper to build and to garbage collect for
+    large `n`.
+  * `:allow` - only return items from this set, either a list of ids or a bitset binary
+    where item `i` is bit `i`, most significant bit of each byte first, eg.
+    `for i <- 0..(n_items - 1), into: <<>>, do: <<if(allowed?(i), do: 1, else: 0)::1>>`
+    padded to whole bytes.  Ids past the end of the bitset are not allowed.
+  * `:deny` - never return items from this set, given like `:allow`.  Only one of
+    `:allow` and `:deny` may be given.
+
+  Filtered items are dropped as the trees are walked, before any distance is computed,
+  and don't count towards `search_k`, so a filtered query inspects as many passing
+  candidates as an unfiltered one would.  With a very selective filter this can mean
+  walking most of the trees.
   """
   @spec get_nns_by_item(
           idx :: reference(),
           i :: pos_integer(),
           n :: pos_integer(),
           search_k :: integer(),
-          include_distances :: boolean()
-        ) :: {list(), list()}
-  def get_nns_by_item(idx, i, n, search_k \\ -1, include_distances \\ true)
+          include_distances :: boolean(),
+          opts :: keyword()
+        ) :: {list(), list()} | {binary(), binary()}
+  def get_nns_by_item(idx, i, n, search_k \\ -1, include_distances \\ true, opts \\ [])
 
-  def get_nns_by_item(_, _, _, _, _) do
+  def get_nns_by_item(_, _, _, _, _, _) do
     exit(:nif_library_not_loaded)
   end
 
   @doc ~S"""
-  Same as `get_nns_by_item` but query by list `v`
+  Same as `get_nns_by_item` but query by vector `v`.
 
-  Returns a 2 element tuple with two lists in it: results and distances.
+  `v` is either a list of numbers or a binary of exactly `f` native-endian float32s,
+  eg. `for x <- list, into: <<>>, do: <<x::float-32-native>>`.  A binary is passed to
+  the index as is, without decoding it element by element.
+
+  Returns a 2 element tuple with two lists in it: results and distances.  Takes the same
+  options as `get_nns_by_item/6`.
   """
   @spec get_nns_by_vector(
           idx :: reference(),
-          v :: list(),
+          v :: list() | binary(),
           n :: pos_integer(),
           search_k :: integer(),
-          include_distances :: boolean()
-        ) :: {list(), list()}
-  def get_nns_by_vector(idx, v, n, search_k \\ -1, include_distances \\ true)
+          include_distances :: boolean(),
+          opts :: keyword()
+        ) :: {list(), list()} | {binary(), binary()}
+  def get_nns_by_vector(idx, v, n, search_k \\ -1, include_distances \\ true, opts \\ [])
 
-  def get_nns_by_vector(_, _, _, _, _) do
+  def get_nns_by_vector(_, _, _, _, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Queries many vectors at once.  `matrix` is a binary of row-major native-endian float32
+  vectors, `f * 4` bytes per query.
+
+  The queries are spread over a bounded set of native threads on a dirty CPU scheduler:
+  the calling scheduler and a pool of one thread per core, shared by all callers and
+  kept from one call to the next.
+  Each thread runs several queries at once, taking turns between them so that one
+  query's next node is fetched from memory while the others run, which helps most on
+  indexes much larger than the CPU caches.  Queries are run in the order of the branches
+  they take down the first tree, so that queries close to each other run together and
+  share the nodes and items they read; with many queries over clustered data, such as
+  when building a nearest neighbour graph, this makes them faster again.
+  Returns one `{ids, distances}` tuple per query, in order, where `ids` is a binary of
+  native-endian int32s and `distances` a binary of native-endian float32s.
+
+  Options:
+  * `:include_distances` - defaults to `true`.  When `false` `distances` is `<<>>`.
+  * `:n_threads` - the most threads to use, defaults to all available CPU cores.
+  * `:format` - `:packed` (the default) or `:list`, see `get_nns_by_item/6`.
+  * `:allow`, `:deny` - a filter applied to every query, see `get_nns_by_item/6`.
+  """
+  @spec get_nns_by_vectors(
+          idx :: reference(),
+          matrix :: binary(),
+          n :: pos_integer(),
+          search_k :: integer(),
+          opts :: keyword()
+        ) :: [{binary(), binary()} | {list(), list()}]
+  def get_nns_by_vectors(idx, matrix, n, search_k \\ -1, opts \\ [])
+
+  def get_nns_by_vectors(_, _, _, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Queries several indexes ("shards") for vector `v` and returns the `n` closest items
+  across all of them, as one `{results, distances}` tuple like `get_nns_by_vector/6`.
+
+  All indexes must have the same metric and number of dimensions.  Each one is queried
+  with `n` and `search_k`, and the results are merged in native code, so only the final
+  `n` items are turned into Erlang terms.  Runs on a dirty CPU scheduler.
+
+  Options:
+  * `:offsets` - a list with one integer per index, added to the ids found in it, eg. the
+    first id of each shard in a global id space.  Shifted ids must fit 32 bits.  Defaults
+    to no offsets, leaving it to the caller to tell the shards apart.
+  * `:include_distances` - defaults to `true`.
+  * `:n_threads` - the most threads to query the indexes with, defaults to all available
+    CPU cores.  `1` queries them one after the other on the calling scheduler.
+  * `:format` - `:list` (the default) or `:packed`, see `get_nns_by_item/6`.
+  """
+  @spec get_nns_multi(
+          idxs :: [reference()],
+          v :: list() | binary(),
+          n :: pos_integer(),
+          search_k :: integer(),
+          opts :: keyword()
+        ) :: {list(), list()} | {binary(), binary()}
+  def get_nns_multi(idxs, v, n, search_k \\ -1, opts \\ [])
+
+  def get_nns_multi(_, _, _, _, _) do
     exit(:nif_library_not_loaded)
   end
 
@@ -127,21 +333,109 @@ defmodule AnnoyEx do
     exit(:nif_library_not_loaded)
   end
 
-  @doc "Adds item `i` (any nonnegative integer) with list `v`"
-  @spec add_item(idx :: reference(), i :: pos_integer(), v :: list()) :: ok_or_err_tuple()
+  @doc ~S"""
+  Returns the order the nodes of the trees are stored in.
+
+  `save/3` writes each tree in page sized blocks, a subtree's top levels breadth first
+  followed depth first by the subtrees below them, so that a query reads fewer pages of
+  a loaded index: `:blocked`.  Indexes in memory, built on disk or loaded from files
+  written before, and quantized ones, keep the order the trees were built in: `:build`.
+  The file records which it is and stays readable by any version.
+  """
+  @spec get_layout(idx :: reference()) :: :blocked | :build
+  def get_layout(idx)
+
+  def get_layout(_) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Returns counters kept by the index currently in `idx`, cheap enough to poll, e.g. to feed
+  `:telemetry`.
+
+  * `:queries` - queries answered.
+  * `:visited_nodes` - tree nodes visited by those queries.
+  * `:distance_evaluations` - candidates whose distance to the query was computed.
+  * `:duplicates` - candidates found in more than one tree, scored only once.
+  * `:latency_histogram` - queries by wall time taken, in 32 buckets: the first counts
+    queries under 1us, bucket `i` those taking from `2^(i-1)` to `2^i` us.
+  * `:reallocations` - times the node array grew while adding items or building.
+  * `:preprocess_us`, `:thread_build_us`, `:roots_copy_us` - wall time of the phases of
+    the last build.  Preprocessing is the `:dot` metric's pass over the item norms, which
+    runs on the threads that then build the trees.
+
+  Counters start at zero with each index, so `load/3`, `swap/3` and `unload/1` reset them.
+  Handles sharing a loaded file (see `load/3`) share its counters too.
+  """
+  @spec stats(idx :: reference()) :: %{atom() => non_neg_integer() | [non_neg_integer()]}
+  def stats(idx)
+
+  def stats(_) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Returns the instruction set the distance kernels run with on this machine.
+
+  The library is built for any x86-64 CPU and picks its kernels when it is loaded:
+  `:avx512f`, `:avx2_fma` or `:sse2`.  `:avx` means it was built with `-mavx`, `:none`
+  that it runs the plain loops, eg. on other architectures.
+  """
+  @spec simd_isa() :: :avx512f | :avx2_fma | :sse2 | :avx | :none
+  def simd_isa do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc ~S"""
+  Adds item `i` (any nonnegative integer) with vector `v`.
+
+  `v` is a list of `f` numbers or a binary of `f` native-endian float32s, see
+  `get_nns_by_vector/6`.
+  """
+  @spec add_item(idx :: reference(), i :: pos_integer(), v :: list() | binary()) ::
+          ok_or_err_tuple()
   def add_item(idx, i, v)
 
   def add_item(_, _, _) do
     exit(:nif_library_not_loaded)
   end
 
+  @doc ~S"""
+  Adds many items at once from `matrix`, a binary of row-major native-endian float32
+  vectors, `f * 4` bytes per row.
+
+  `ids` is either the integer id of the first row, the rest being added as consecutive
+  items, or a binary of one native-endian int32 id per row.  Ids should be unique.
+
+  Storage for the whole batch is reserved once and the rows are copied in on a dirty
+  CPU scheduler.  With a multi-threaded build `n_jobs` threads initialize the rows,
+  `n_jobs=-1` uses all available CPU cores; the threads are started for the call, and
+  only for batches of a few thousand rows or more.  `add_item/3` initializes its one row
+  on the calling scheduler, so add many rows with `add_items/4`.
+  """
+  @spec add_items(
+          idx :: reference(),
+          ids :: non_neg_integer() | binary(),
+          matrix :: binary(),
+          n_jobs :: integer()
+        ) :: ok_or_err_tuple()
+  def add_items(idx, ids, matrix, n_jobs \\ -1)
+
+  def add_items(_, _, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
   @doc ~S"""
   builds a forest of `n_trees` trees. More trees gives higher precision when querying. 
 
   After calling build, no more items can be added. 
 
   `n_jobs` specifies the number of threads used to build the trees.
-  `n_jobs=-1` uses all available CPU cores.
+  `n_jobs=-1` uses all available CPU cores.  Large subtrees are built as tasks that
+  idle threads take over, so even a single tree is built on all of them.  The trees
+  depend on the seed alone, not on `n_jobs`, and so does the saved file.
+
+  Runs on a dirty CPU scheduler.  See `build_async/3` for a non-blocking variant.
   """
   @spec build(idx :: reference(), n_trees :: pos_integer(), n_jobs :: integer()) ::
           ok_or_err_tuple()
@@ -162,6 +456,10 @@ defmodule AnnoyEx do
   @doc ~S"""
   prepares annoy to build the index in the specified file instead of RAM 
   (execute before adding items, no need to save after build)
+
+  Building then keeps a buffer of about a thousand nodes per build thread in RAM, and
+  4 bytes per tree node while the trees are laid out in the file at the end.  Building in
+  RAM instead peaks at the items plus twice the size of the trees.
   """
   @spec on_disk_build(idx :: reference(), filename :: binary()) :: ok_or_err_tuple()
   def on_disk_build(idx, filename)
@@ -190,4 +488,46 @@ defmodule AnnoyEx do
   def verbose(_, _) do
     exit(:nif_library_not_loaded)
   end
+
+  @doc ~S"""
+  Same as `build/3` but runs on a background thread.
+
+  Returns a reference right away.  When the build finishes the calling process is sent
+  `{ref, result}` where `result` is what `build/3` would have returned.  See `await/2`.
+  """
+  @spec build_async(idx :: reference(), n_trees :: pos_integer(), n_jobs :: integer()) ::
+          reference() | {:err, String.t()}
+  def build_async(idx, n_trees, n_jobs \\ -1)
+
+  def build_async(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc "Same as `save/3` but runs on a background thread, replying like `build_async/3`."
+  @spec save_async(idx :: reference(), filename :: binary(), prefault :: boolean()) ::
+          reference() | {:err, String.t()}
+  def save_async(idx, filename, prefault \\ false)
+
+  def save_async(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc "Same as `load/3` but runs on a background thread, replying like `build_async/3`."
+  @spec load_async(idx :: reference(), filename :: binary(), preload :: boolean()) ::
+          reference() | {:err, String.t()}
+  def load_async(idx, filename, preload \\ false)
+
+  def load_async(_, _, _) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @doc "Waits for the result of one of the `*_async` functions."
+  @spec await(ref :: reference(), timeout :: timeout()) :: ok_or_err_tuple()
+  def await(ref, timeout \\ :infinity) do
+    receive do
+      {^ref, result} -> result
+    after
+      timeout -> exit({:timeout, {__MODULE__, :await, [ref, timeout]}})
+    end
+  end
 end
@@ -2,6 +2,18 @@
 #include "annoylib.h"
 #include "kissrandom.h"
 #include <string>
+#include <new>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <tuple>
+#include <sys/stat.h>
 
 using namespace Annoy;
 
@@ -18,16 +30,67 @@ typedef AnnoyIndex<int32_t, float, DotProduct, Kiss64Random, AnnoyIndexThreadedB
 typedef AnnoyIndex<int32_t, float, Euclidean, Kiss64Random, AnnoyIndexThreadedBuildPolicy> AnnoyIndexEuclidean;
 typedef AnnoyIndex<int32_t, float, Manhattan, Kiss64Random, AnnoyIndexThreadedBuildPolicy> AnnoyIndexManhattan;
 
+
 static ErlNifResourceType* ANNOY_INDEX_RESOURCE;
 
+typedef std::shared_ptr<AnnoyIndexInterface<int32_t, float> > annoy_index_ptr;
+
 typedef struct
 {
   // number of dimensions.
   int f;
-  // the Annoy index instance.
-   AnnoyIndexInterface<int32_t, float>* idx;
+  // the metric atom, to create replacement indexes with.
+  ERL_NIF_TERM metric;
+  // the dtype atom.  Anything but float32 is built in float32 and saved and
+  // loaded as a quantized index with 16 bit elements.
+  ERL_NIF_TERM dtype;
+  bool verbose;
+  // the Annoy index instance.  Only ever read or replaced atomically, see
+  // current_index and swap_index, so that loading an index never pulls the
+  // old one out from under queries still using it.
+  annoy_index_ptr idx;
+  // taken shared by calls reading the index and exclusively by calls that
+  // change it in place, like add_item, build or save.
+  ErlNifRWLock* lock;
 } ex_annoy;
 
+static ErlNifResourceType* ANNOY_QUERY_RESOURCE;
+
+// a query that has used up its time slice, waiting to be continued.
+typedef struct
+{
+  // the handle and index being queried, kept alive for as long as the query is.
+  ex_annoy* handle;
+  annoy_index_ptr idx;
+  AnnoyQueryState<int32_t, float> state;
+  // what the query was begun with, to begin it again if the index changed
+  // while it was suspended, see annoy_query_continue.
+  uint64_t generation;
+  std::vector<float> vector;
+  int32_t n;
+  int32_t search_k;
+  bool include_distances;
+  bool packed;
+  // keeps the filter of the query alive, see query_filter.
+  ErlNifEnv* filter_env;
+  std::vector<unsigned char> filter_bits;
+} ex_annoy_query;
+
+// the :allow or :deny option of a query.  A bitset binary is used in place,
+// a list of ids is turned into a bitset kept in bits.
+typedef struct
+{
+  ERL_NIF_TERM binary;
+  std::vector<unsigned char> bits;
+} query_filter;
+
+// nodes visited or candidates scored between two looks at the clock.
+#define QUERY_SLICE_STEPS 128
+
+// rows of get_nns_by_vectors a thread takes at a time: as many as it runs
+// at once, since each holds a bitset over the items until it is finished.
+#define QUERY_GROUP_ROWS ANNOYLIB_INTERLEAVE
+
 struct atoms
 {
   ERL_NIF_TERM a_ok;
@@ -38,6 +101,23 @@ struct atoms
   ERL_NIF_TERM a_manhattan;
   ERL_NIF_TERM a_dot;
   ERL_NIF_TERM a_angular;
+  ERL_NIF_TERM a_include_distances;
+  ERL_NIF_TERM a_n_threads;
+  ERL_NIF_TERM a_format;
+  ERL_NIF_TERM a_list;
+  ERL_NIF_TERM a_packed;
+  ERL_NIF_TERM a_allow;
+  ERL_NIF_TERM a_deny;
+  ERL_NIF_TERM a_offsets;
+  ERL_NIF_TERM a_vectors;
+  ERL_NIF_TERM a_rerank;
+  ERL_NIF_TERM a_prefault;
+  ERL_NIF_TERM a_dtype;
+  ERL_NIF_TERM a_int8;
+  ERL_NIF_TERM a_float32;
+  ERL_NIF_TERM a_float16;
+  ERL_NIF_TERM a_bfloat16;
+  ERL_NIF_TERM a_pq;
 };
 
 static atoms ATOMS;
@@ -46,43 +126,68 @@ extern "C"
 {
     ERL_NIF_TERM annoy_new_index(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_add_item(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_add_items(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_build(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_unbuild(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_save(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_load(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_swap(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_unload(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);  
     ERL_NIF_TERM annoy_get_nns_by_item(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_get_nns_by_vector(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_get_nns_by_vectors(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_get_nns_multi(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_get_item_vector(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_get_distance(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_get_n_items(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_get_n_trees(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_get_layout(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_on_disk_build(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_verbose(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
     ERL_NIF_TERM annoy_set_seed(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);  
+    ERL_NIF_TERM annoy_build_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_save_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_load_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_simd_isa(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_save_quantized(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM annoy_load_quantized(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
   
     void annoy_index_dtor(ErlNifEnv* env, void* arg);
+    void annoy_query_dtor(ErlNifEnv* env, void* arg);
 
     int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info);
     
     static ErlNifFunc funcs[] =
     {
-      {"new",               2, annoy_new_index,         0},
+      {"new",               3, annoy_new_index,         0},
       {"add_item",          3, annoy_add_item,          0},
-      {"build",             3, annoy_build,             0},
+      {"add_items",         4, annoy_add_items,         ERL_NIF_DIRTY_JOB_CPU_BOUND},
+      {"build",             3, annoy_build,             ERL_NIF_DIRTY_JOB_CPU_BOUND},
       {"unbuild",           1, annoy_unbuild,           0},
-      {"save",              3, annoy_save,              0},
-      {"load",              3, annoy_load,              0},
+      {"save",              3, annoy_save,              ERL_NIF_DIRTY_JOB_IO_BOUND},
+      {"load",              3, annoy_load,              ERL_NIF_DIRTY_JOB_IO_BOUND},
+      {"swap",              3, annoy_swap,              ERL_NIF_DIRTY_JOB_IO_BOUND},
       {"unload",            1, annoy_unload,            0},
-      {"get_nns_by_item",   5, annoy_get_nns_by_item,   0},
-      {"get_nns_by_vector", 5, annoy_get_nns_by_vector, 0},
+      {"get_nns_by_item",   6, annoy_get_nns_by_item,   0},
+      {"get_nns_by_vector", 6, annoy_get_nns_by_vector, 0},
+      {"get_nns_by_vectors", 5, annoy_get_nns_by_vectors, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+      {"get_nns_multi",     5, annoy_get_nns_multi,     ERL_NIF_DIRTY_JOB_CPU_BOUND},
       {"get_item_vector",   2, annoy_get_item_vector,   0},
       {"get_distance",      3, annoy_get_distance,      0},
       {"get_n_items",       1, annoy_get_n_items,       0},
       {"get_n_trees",       1, annoy_get_n_trees,       0},
-      {"on_disk_build",     2, annoy_on_disk_build,     0},
+      {"get_layout",        1, annoy_get_layout,        0},
+      {"on_disk_build",     2, annoy_on_disk_build,     ERL_NIF_DIRTY_JOB_IO_BOUND},
       {"verbose",           2, annoy_verbose,           0},
       {"set_seed",          2, annoy_set_seed,          0},
+      {"build_async",       3, annoy_build_async,       0},
+      {"save_async",        3, annoy_save_async,        0},
+      {"load_async",        3, annoy_load_async,        0},
+      {"stats",             1, annoy_stats,             0},
+      {"simd_isa",          0, annoy_simd_isa,          0},
+      {"save_quantized",    3, annoy_save_quantized,    ERL_NIF_DIRTY_JOB_IO_BOUND},
+      {"load_quantized",    3, annoy_load_quantized,    ERL_NIF_DIRTY_JOB_IO_BOUND},
     };
 
     ERL_NIF_INIT(Elixir.AnnoyEx, funcs, &on_load, NULL, NULL, NULL)
@@ -143,6 +248,179 @@ bool get_vector_item(ErlNifEnv *env, ERL_NIF_TERM item, double* d) {
   return true;
 }
 
+// populate *v with the f dimensional vector in term.  term is either a list
+// of numbers or a binary of exactly f native-endian float32s.  A binary is
+// used in place; w is only filled when the data has to be converted or
+// realigned.
+bool get_vector(ErlNifEnv *env, ERL_NIF_TERM term, int f, vector<float>* w, const float** v) {
+  ErlNifBinary bin;
+  ERL_NIF_TERM item;
+  unsigned int arity;
+  double d;
+
+  if(enif_is_binary(env, term)) {
+    if(!enif_inspect_binary(env, term, &bin))
+      return false;
+
+    if(bin.size != f * sizeof(float)) {
+      enif_fprintf(stderr, "Vector has wrong size (expected %d bytes, got %d)\n", (int)(f * sizeof(float)), (int)bin.size);
+      return false;
+    }
+
+    if(reinterpret_cast<uintptr_t>(bin.data) % alignof(float) == 0) {
+      *v = reinterpret_cast<const float*>(bin.data);
+    } else {
+      w->resize(f);
+      memcpy(&(*w)[0], bin.data, bin.size);
+      *v = &(*w)[0];
+    }
+
+    return true;
+  }
+
+  if(!enif_get_list_length(env, term, &arity))
+    return false;
+
+  if((unsigned)f != arity) {
+    enif_fprintf(stderr, "Vector has wrong length (expected %d, got %d)\n", f, arity);
+    return false;
+  }
+
+  w->resize(f);
+
+  for(unsigned int i=0; i<arity; i++) {
+    if(!enif_get_list_cell(env, term, &item, &term)) {
+      enif_fprintf(stderr, "Could not get list item.\n");
+      return false;
+    }
+
+    if(!get_vector_item(env, item, &d)) {
+      enif_fprintf(stderr, "failed to convert item %d to int or double\n", i);
+      return false;
+    }
+
+    (*w)[i] = d;
+  }
+
+  *v = &(*w)[0];
+  return true;
+}
+
+// populate *v with the rows of a packed row-major matrix of native-endian
+// float32s, f per row.  As with get_vector the binary is used in place
+// unless it has to be realigned into w.
+bool get_matrix(ErlNifEnv *env, ERL_NIF_TERM term, int f, vector<float>* w, const float** v, size_t* rows) {
+  ErlNifBinary bin;
+  size_t row_size = f * sizeof(float);
+
+  if(!enif_inspect_binary(env, term, &bin))
+    return false;
+
+  if(bin.size % row_size) {
+    enif_fprintf(stderr, "Matrix size is not a multiple of the vector size (%d bytes)\n", (int)row_size);
+    return false;
+  }
+
+  *rows = bin.size / row_size;
+  *v = reinterpret_cast<const float*>(bin.data);
+
+  if(bin.size && reinterpret_cast<uintptr_t>(bin.data) % alignof(float)) {
+    w->resize(*rows * f);
+    memcpy(&(*w)[0], bin.data, bin.size);
+    *v = &(*w)[0];
+  }
+
+  return true;
+}
+
+// find key in the keyword list opts.  Returns false if opts is not a proper
+// keyword list, leaving *value untouched when the key is not present.
+bool get_option(ErlNifEnv* env, ERL_NIF_TERM opts, ERL_NIF_TERM key, ERL_NIF_TERM* value) {
+  ERL_NIF_TERM head;
+  const ERL_NIF_TERM* pair;
+  int arity;
+
+  while(enif_get_list_cell(env, opts, &head, &opts)) {
+    if(!enif_get_tuple(env, head, &arity, &pair) || arity != 2 || !enif_is_atom(env, pair[0]))
+      return false;
+
+    if(enif_is_identical(pair[0], key)) {
+      *value = pair[1];
+      break;
+    }
+  }
+
+  return enif_is_list(env, opts);
+}
+
+// read the :format option, :list or :packed, into *packed.
+bool get_format(ErlNifEnv* env, ERL_NIF_TERM opts, bool* packed) {
+  ERL_NIF_TERM format = *packed ? ATOMS.a_packed : ATOMS.a_list;
+
+  if(!get_option(env, opts, ATOMS.a_format, &format))
+    return false;
+
+  if(enif_is_identical(format, ATOMS.a_packed)) {
+    *packed = true;
+  } else if(enif_is_identical(format, ATOMS.a_list)) {
+    *packed = false;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+// read the :allow or :deny option into filter and point state at it.  Only
+// one of them may be given.
+bool get_filter(ErlNifEnv* env, ERL_NIF_TERM opts, query_filter* filter, AnnoyQueryState<int32_t, float>* state) {
+  ERL_NIF_TERM allow = 0, deny = 0, term;
+  ErlNifBinary bin;
+
+  filter->binary = 0;
+
+  if(!(get_option(env, opts, ATOMS.a_allow, &allow) && get_option(env, opts, ATOMS.a_deny, &deny)))
+    return false;
+
+  if(allow && deny)
+    return false;
+  if(!allow && !deny)
+    return true;
+
+  term = allow ? allow : deny;
+  state->filter_deny = !allow;
+
+  if(enif_inspect_binary(env, term, &bin)) {
+    filter->binary = term;
+    state->filter = bin.data;
+    state->filter_size = bin.size;
+    return true;
+  }
+
+  ERL_NIF_TERM head;
+  int32_t id;
+
+  if(!enif_is_list(env, term))
+    return false;
+
+  while(enif_get_list_cell(env, term, &head, &term)) {
+    if(!enif_get_int(env, head, &id) || id < 0)
+      return false;
+
+    size_t byte = (size_t)id >> 3;
+    if(byte >= filter->bits.size())
+      filter->bits.resize(byte + 1, 0);
+
+    filter->bits[byte] |= 0x80 >> (id & 7);
+  }
+
+  // an empty list allows nothing, or denies nothing.
+  static const unsigned char none = 0;
+  state->filter = filter->bits.empty() ? &none : &filter->bits[0];
+  state->filter_size = filter->bits.size();
+  return true;
+}
+
 ERL_NIF_TERM make_atom(ErlNifEnv* env, const char* name)
 {
     ERL_NIF_TERM ret;
@@ -158,11 +436,270 @@ ERL_NIF_TERM error_tuple(ErlNifEnv* env, const char* name)
   return enif_make_tuple2(env, ATOMS.a_err, enif_make_string(env, name, ERL_NIF_LATIN1));
 }
 
-bool check_constraints(ex_annoy *handle, int32_t item, bool building) {
+// whether the calling thread may wait for the lock of an index.  Builds and
+// saves hold it for as long as they take, which must not hold up a normal
+// scheduler; see retry_later.
+bool may_wait() {
+  return enif_thread_type() != ERL_NIF_THR_NORMAL_SCHEDULER;
+}
+
+// holds the lock of an index shared for as long as it is in scope.  On a
+// normal scheduler it is only taken if it is free, see held.
+struct read_lock
+{
+  ErlNifRWLock* lock;
+  bool held;
+
+  read_lock(ex_annoy* handle) : lock(handle->lock), held(true) {
+    if(may_wait())
+      enif_rwlock_rlock(lock);
+    else
+      held = enif_rwlock_tryrlock(lock) == 0;
+  }
+  ~read_lock() { if(held) enif_rwlock_runlock(lock); }
+};
+
+// holds the lock of an index exclusively for as long as it is in scope.  On
+// a normal scheduler it is only taken if it is free, see held.
+struct write_lock
+{
+  ErlNifRWLock* lock;
+  bool held;
+
+  write_lock(ex_annoy* handle) : lock(handle->lock), held(true) {
+    if(may_wait())
+      enif_rwlock_rwlock(lock);
+    else
+      held = enif_rwlock_tryrwlock(lock) == 0;
+  }
+  ~write_lock() { if(held) enif_rwlock_rwunlock(lock); }
+};
+
+// Calls nif again once the calling process has been scheduled again, on a
+// normal scheduler, to retry taking the lock it could not take.  Waiting on a
+// dirty I/O scheduler instead would take one from file operations for as
+// long as a build runs, and a few queries would take them all.  The process
+// gives up the rest of its time slice, so it polls no more often than it is
+// scheduled.
+ERL_NIF_TERM retry_later(ErlNifEnv* env, const char* name,
+                         ERL_NIF_TERM (*nif)(ErlNifEnv*, int, const ERL_NIF_TERM[]),
+                         int argc, const ERL_NIF_TERM argv[]) {
+  enif_consume_timeslice(env, 100);
+  return enif_schedule_nif(env, name, 0, nif, argc, argv);
+}
+
+// the index currently in use.  Keeping the returned pointer around keeps the
+// index alive, even if it is swapped out meanwhile.
+annoy_index_ptr current_index(ex_annoy* handle) {
+  return std::atomic_load(&handle->idx);
+}
+
+// a new, empty index, or NULL if metric is not known.
+AnnoyIndexInterface<int32_t, float>* make_index(ERL_NIF_TERM metric, int f) {
+  if(enif_is_identical(metric, ATOMS.a_dot)) {
+    return new AnnoyIndexDotProduct(f);
+  } else if(enif_is_identical(metric, ATOMS.a_euclidean)) {
+    return new AnnoyIndexEuclidean(f);
+  } else if(enif_is_identical(metric, ATOMS.a_manhattan)) {
+    return new AnnoyIndexManhattan(f);
+  } else if(enif_is_identical(metric, ATOMS.a_angular)) {
+    return new AnnoyIndexAngular(f);
+  }
+
+  return NULL;
+}
+
+// a new, empty quantized index with elements C, or NULL if metric is not known.
+template<typename C>
+AnnoyQuantizedIndexInterface<int32_t, float>* make_quantized_index(ERL_NIF_TERM metric, int f) {
+  if(enif_is_identical(metric, ATOMS.a_dot)) {
+    return new AnnoyQuantizedIndex<int32_t, float, DotProduct, C>(f);
+  } else if(enif_is_identical(metric, ATOMS.a_euclidean)) {
+    return new AnnoyQuantizedIndex<int32_t, float, Euclidean, C>(f);
+  } else if(enif_is_identical(metric, ATOMS.a_manhattan)) {
+    return new AnnoyQuantizedIndex<int32_t, float, Manhattan, C>(f);
+  } else if(enif_is_identical(metric, ATOMS.a_angular)) {
+    return new AnnoyQuantizedIndex<int32_t, float, Angular, C>(f);
+  }
+
+  return NULL;
+}
+
+// a new, empty index to load files saved by handle into.
+AnnoyIndexInterface<int32_t, float>* make_loaded_index(ex_annoy* handle) {
+  if(enif_is_identical(handle->dtype, ATOMS.a_float16)) {
+    return make_quantized_index<annoy_float16>(handle->metric, handle->f);
+  } else if(enif_is_identical(handle->dtype, ATOMS.a_bfloat16)) {
+    return make_quantized_index<annoy_bfloat16>(handle->metric, handle->f);
+  }
+
+  return make_index(handle->metric, handle->f);
+}
+
+// the element type named by the :dtype option of save_quantized.
+bool get_quantized_element(ERL_NIF_TERM dtype, AnnoyElementType* element) {
+  if(enif_is_identical(dtype, ATOMS.a_int8)) {
+    *element = ANNOYLIB_ELEMENT_INT8;
+  } else if(enif_is_identical(dtype, ATOMS.a_float16)) {
+    *element = ANNOYLIB_ELEMENT_FLOAT16;
+  } else if(enif_is_identical(dtype, ATOMS.a_bfloat16)) {
+    *element = ANNOYLIB_ELEMENT_BFLOAT16;
+  } else if(enif_is_identical(dtype, ATOMS.a_float32)) {
+    *element = ANNOYLIB_ELEMENT_FLOAT32;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// whether handle stores its vectors as 16 bit elements, and which.
+bool get_half_element(ex_annoy* handle, AnnoyElementType* element) {
+  if(enif_is_identical(handle->dtype, ATOMS.a_float16)) {
+    *element = ANNOYLIB_ELEMENT_FLOAT16;
+    return true;
+  } else if(enif_is_identical(handle->dtype, ATOMS.a_bfloat16)) {
+    *element = ANNOYLIB_ELEMENT_BFLOAT16;
+    return true;
+  }
+
+  return false;
+}
+
+// Indexes loaded from files, by file identity, metric, dtype and dimensions,
+// so that every handle loading the same file shares one mapping of it.
+// Entries do not keep their index alive; it is unloaded with the last handle
+// using it.  Atoms are immediates, so the metric and dtype terms themselves
+// identify them.
+typedef std::tuple<dev_t, ino_t, off_t, time_t, long, ERL_NIF_TERM, ERL_NIF_TERM, int> loaded_index_key;
+
+static std::mutex LOADED_INDEXES_LOCK;
+static std::map<loaded_index_key, std::weak_ptr<AnnoyIndexInterface<int32_t, float> > > LOADED_INDEXES;
+
+bool get_loaded_index_key(ex_annoy* handle, const char* file, loaded_index_key* key) {
+  struct stat st;
+
+  if(stat(file, &st) == -1)
+    return false;
+
+  *key = std::make_tuple(st.st_dev, st.st_ino, st.st_size,
+                         st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+                         handle->metric, handle->dtype, handle->f);
+  return true;
+}
+
+// Loads file, or hands out the index another handle already loaded from it.
+// A file that was rewritten since is loaded afresh.
+annoy_index_ptr load_index(ex_annoy* handle, const char* file, bool prefault, char** error) {
+  loaded_index_key key, loaded_key;
+  bool shared = get_loaded_index_key(handle, file, &key);
+
+  if(shared) {
+    std::lock_guard<std::mutex> guard(LOADED_INDEXES_LOCK);
+    auto it = LOADED_INDEXES.find(key);
+
+    if(it != LOADED_INDEXES.end()) {
+      annoy_index_ptr idx = it->second.lock();
+      if(idx)
+        return idx;
+    }
+  }
+
+  annoy_index_ptr idx(make_loaded_index(handle));
+
+  idx->verbose(handle->verbose);
+
+  if(!idx->load(file, prefault, error))
+    return annoy_index_ptr();
+
+  // only share what was loaded if the file did not change meanwhile.
+  if(shared && get_loaded_index_key(handle, file, &loaded_key) && loaded_key == key) {
+    std::lock_guard<std::mutex> guard(LOADED_INDEXES_LOCK);
+
+    for(auto it = LOADED_INDEXES.begin(); it != LOADED_INDEXES.end(); ) {
+      if(it->second.expired())
+        it = LOADED_INDEXES.erase(it);
+      else
+        ++it;
+    }
+
+    // another handle may have loaded the same file at the same time.
+    auto it = LOADED_INDEXES.find(key);
+    if(it != LOADED_INDEXES.end())
+      return it->second.lock();
+
+    LOADED_INDEXES.emplace(key, idx);
+  }
+
+  return idx;
+}
+
+// Replaces the index with a new one, loaded from file unless file is NULL.
+// Queries running against the old index finish with it; it is unloaded
+// when the last of them lets go.
+bool swap_index(ex_annoy* handle, const char* file, bool prefault, char** error) {
+  annoy_index_ptr idx;
+
+  if(file) {
+    idx = load_index(handle, file, prefault, error);
+    if(!idx)
+      return false;
+  } else {
+    idx.reset(make_index(handle->metric, handle->f));
+    idx->verbose(handle->verbose);
+  }
+
+  std::atomic_store(&handle->idx, idx);
+  return true;
+}
+
+// Saves the index to file.  With a 16 bit dtype a built index is written as
+// a quantized one and then loaded from it, like AnnoyIndex::save does for
+// float32; an index already loaded is copied as it is.
+bool save_index(ex_annoy* handle, const char* file, bool prefault, char** error) {
+  annoy_index_ptr idx = current_index(handle);
+  AnnoyElementType element;
+
+  if(!get_half_element(handle, &element) ||
+     dynamic_cast<AnnoyQuantizedIndexInterface<int32_t, float>*>(idx.get()))
+    return idx->save(file, prefault, error);
+
+  return idx->save_quantized(file, element, NULL, error) && swap_index(handle, file, prefault, error);
+}
+
+// Runs job on a thread of its own and sends {ref, result} to the calling
+// process once it finishes.  The index resource is kept alive until then.
+template<typename Job>
+ERL_NIF_TERM run_async(ErlNifEnv* env, ex_annoy* handle, Job job) {
+  ErlNifPid pid;
+  ErlNifEnv* msg_env = enif_alloc_env();
+  ERL_NIF_TERM ref = enif_make_ref(env);
+  ERL_NIF_TERM msg_ref = enif_make_copy(msg_env, ref);
+
+  enif_self(env, &pid);
+  enif_keep_resource(handle);
+
+  try {
+    std::thread([=]() {
+      ERL_NIF_TERM result = job(msg_env);
+
+      enif_send(NULL, &pid, msg_env, enif_make_tuple2(msg_env, msg_ref, result));
+      enif_free_env(msg_env);
+      enif_release_resource(handle);
+    }).detach();
+  } catch(const std::system_error&) {
+    enif_free_env(msg_env);
+    enif_release_resource(handle);
+    return error_tuple(env, "Unable to start thread");
+  }
+
+  return ref;
+}
+
+bool check_constraints(AnnoyIndexInterface<int32_t, float>* idx, int32_t item, bool building) {
   if (item < 0) {
     enif_fprintf(stderr, "Item index can not be negative");
     return false;
-  } else if (!building && item >= handle->idx->get_n_items()) {
+  } else if (!building && item >= idx->get_n_items()) {
     enif_fprintf(stderr, "Item index larger than the largest item index");
     return false;
   } else {
@@ -172,48 +709,269 @@ bool check_constraints(ex_annoy *handle, int32_t item, bool building) {
 
 ERL_NIF_TERM
 nns_to_ex(ErlNifEnv *env, const vector<int32_t>& result, const vector<float>& distances, int include_distances) {
-  ERL_NIF_TERM l = enif_make_list(env, 0);
-  ERL_NIF_TERM d = enif_make_list(env, 0);
+  vector<ERL_NIF_TERM> terms(result.size());
+  ERL_NIF_TERM l, d;
 
   for(size_t i = 0; i < result.size(); i++)
-    l = enif_make_list_cell(env, enif_make_int(env, result[i]), l);
-  
-  enif_make_reverse_list(env, l, &l);
+    terms[i] = enif_make_int(env, result[i]);
 
-  if(include_distances) {
-    for(size_t i = 0; i < distances.size(); i++)
-      d = enif_make_list_cell(env, enif_make_double(env, distances[i]), d);
-  
-    enif_make_reverse_list(env, d, &d);
-  }
+  l = enif_make_list_from_array(env, terms.empty() ? NULL : &terms[0], terms.size());
+
+  terms.resize(include_distances ? distances.size() : 0);
+  for(size_t i = 0; i < terms.size(); i++)
+    terms[i] = enif_make_double(env, distances[i]);
+
+  d = enif_make_list_from_array(env, terms.empty() ? NULL : &terms[0], terms.size());
 
   return enif_make_tuple2(env, l, d);
 }  
 
+// results as {ids, distances}: the ids packed as native-endian int32s and the
+// distances as native-endian float32s.  Both are sub-binaries of a single
+// allocation.
+ERL_NIF_TERM
+nns_to_packed(ErlNifEnv *env, const vector<int32_t>& result, const vector<float>& distances, int include_distances) {
+  size_t ids_size = result.size() * sizeof(int32_t);
+  size_t dists_size = include_distances ? distances.size() * sizeof(float) : 0;
+  ERL_NIF_TERM bin;
+  unsigned char* data = enif_make_new_binary(env, ids_size + dists_size, &bin);
+
+  if(ids_size)
+    memcpy(data, &result[0], ids_size);
+  if(dists_size)
+    memcpy(data + ids_size, &distances[0], dists_size);
+
+  return enif_make_tuple2(env,
+                          enif_make_sub_binary(env, bin, 0, ids_size),
+                          enif_make_sub_binary(env, bin, ids_size, dists_size));
+}
+
+// Threads shared by every batched query.  They are started on first use, one
+// per core, and live as long as the VM, so that what they keep per thread
+// (eg. AnnoyQueryContext::local()) is reused from one call to the next and
+// the number of threads stays bounded however many processes query at once.
+class QueryPool {
+public:
+  static QueryPool& get() {
+    static QueryPool* pool = new QueryPool();  // never joined nor freed.
+    return *pool;
+  }
+
+  size_t n_threads() const { return _n_threads; }
+
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _jobs.push_back(std::move(job));
+    }
+    _wake.notify_one();
+  }
+
+private:
+  QueryPool() : _n_threads(0) {
+    int n_cores = std::max(1, (int)std::thread::hardware_concurrency());
+    try {
+      for(int t = 0; t < n_cores; t++, _n_threads++)
+        std::thread(&QueryPool::run, this).detach();
+    } catch(const std::system_error&) {
+      // carry on with the threads we have.
+    }
+  }
+
+  void run() {
+    for(;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [this]() { return !_jobs.empty(); });
+        job = std::move(_jobs.front());
+        _jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  size_t _n_threads;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::deque<std::function<void()> > _jobs;
+};
+
+// Calls f(i) for every i in [0, n), handing indices out to at most n_threads
+// threads (all cores when n_threads <= 0): the calling thread and threads of
+// the QueryPool.  Returns once every f(i) has returned.
+template<typename F>
+void fan_out(size_t n, int n_threads, F f) {
+  struct Batch {
+    std::function<void(size_t)> f;
+    size_t n;
+    std::atomic<size_t> next;
+    std::atomic<int> running;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // Helpers queued behind other batches may only start once the caller has
+    // handed out every index; they find none left and never touch f.
+    void work() {
+      running++;
+      for(size_t i = next++; i < n; i = next++)
+        f(i);
+      if(--running == 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  };
+
+  QueryPool& pool = QueryPool::get();
+  size_t n_cores = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
+  size_t n_workers = std::min(n_threads > 0 ? std::min((size_t)n_threads, n_cores) : n_cores, n);
+  size_t n_helpers = std::min(n_workers ? n_workers - 1 : 0, pool.n_threads());
+
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->f = f;
+  batch->n = n;
+  batch->next = 0;
+  batch->running = 0;
+
+  for(size_t t = 0; t < n_helpers; t++)
+    pool.submit([batch]() { batch->work(); });
+
+  batch->work();
+
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->done.wait(lock, [&]() { return batch->running == 0; });
+}
+
+// Runs a query until it is done (true) or the calling process has used up
+// its time slice (false).  The caller holds the lock of the index.
+bool advance_query(ErlNifEnv* env, AnnoyIndexInterface<int32_t, float>* idx,
+                   AnnoyQueryState<int32_t, float>* state) {
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  while(!idx->query_advance(state, QUERY_SLICE_STEPS)) {
+    ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+    // a time slice is about a millisecond.
+    int percent = (int)std::max((ErlNifTime)1, std::min((ErlNifTime)100, (now - start) / 10));
+
+    start = now;
+    if(enif_consume_timeslice(env, percent))
+      return false;
+  }
+
+  return true;
+}
+
+ERL_NIF_TERM finish_query(ErlNifEnv* env, AnnoyIndexInterface<int32_t, float>* idx, AnnoyQueryState<int32_t, float>* state,
+                          bool include_distances, bool packed) {
+  AnnoyQueryContext<int32_t, float>& context = AnnoyQueryContext<int32_t, float>::local();
+  vector<int32_t>& result = context.result;
+  vector<float>& distances = context.distances;
+
+  result.clear();
+  distances.clear();
+  idx->query_finish(state, &result, include_distances ? &distances : NULL);
+
+  if(packed)
+    return nns_to_packed(env, result, distances, include_distances);
+
+  return nns_to_ex(env, result, distances, include_distances);
+}
+
+ERL_NIF_TERM annoy_query_continue(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy_query* query;
+
+  if(!enif_get_resource(env, argv[0], ANNOY_QUERY_RESOURCE, (void**)&query))
+    return enif_make_badarg(env);
+
+  read_lock lock(query->handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_nns", annoy_query_continue, argc, argv);
+
+  // the index was built anew, or had items added, since the query was
+  // suspended: the nodes it was about to visit are gone.
+  if(query->idx->get_generation() != query->generation) {
+    query->idx->query_begin_by_vector(&query->state, &query->vector[0], query->n, query->search_k);
+    query->generation = query->idx->get_generation();
+  }
+
+  if(!advance_query(env, query->idx.get(), &query->state))
+    return enif_schedule_nif(env, "get_nns", 0, annoy_query_continue, argc, argv);
+
+  ERL_NIF_TERM result = finish_query(env, query->idx.get(), &query->state, query->include_distances, query->packed);
+
+  // the next query on this thread reuses the buffers.
+  AnnoyQueryContext<int32_t, float>::local().state = std::move(query->state);
+  return result;
+}
+
+// Moves a query that ran out of time into a resource and reschedules it, so
+// that long queries give way to other processes on the scheduler.
+// v, n and search_k are what the query was begun with.
+ERL_NIF_TERM yield_query(ErlNifEnv* env, ex_annoy* handle, const annoy_index_ptr& idx, AnnoyQueryState<int32_t, float>* state,
+                         const float* v, int32_t n, int32_t search_k,
+                         query_filter* filter, bool include_distances, bool packed) {
+  ex_annoy_query* query = (ex_annoy_query*)enif_alloc_resource(ANNOY_QUERY_RESOURCE, sizeof(ex_annoy_query));
+
+  new (query) ex_annoy_query();
+  enif_keep_resource(handle);
+  query->handle = handle;
+  query->idx = idx;
+  // the buffers move along with the query, the bitset over the items among
+  // them; annoy_query_continue hands them back to a query context.
+  query->state = std::move(*state);
+  query->generation = idx->get_generation();
+  query->vector.assign(v, v + handle->f);
+  query->n = n;
+  query->search_k = search_k;
+  query->include_distances = include_distances;
+  query->packed = packed;
+  query->filter_env = NULL;
+
+  // the filter has to outlive this call: keep a reference to a binary, or
+  // take the bitset built from a list, whose buffer stays where it is.
+  if(filter->binary) {
+    ErlNifBinary bin;
+
+    query->filter_env = enif_alloc_env();
+    enif_inspect_binary(query->filter_env, enif_make_copy(query->filter_env, filter->binary), &bin);
+    query->state.filter = bin.data;
+  } else {
+    query->filter_bits = std::move(filter->bits);
+  }
+
+  ERL_NIF_TERM args[] = { enif_make_resource(env, query) };
+  enif_release_resource(query);
+
+  return enif_schedule_nif(env, "get_nns", 0, annoy_query_continue, 1, args);
+}
+
 ERL_NIF_TERM annoy_new_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) 
 {
   int f;
+  ERL_NIF_TERM dtype = ATOMS.a_float32;
+  AnnoyIndexInterface<int32_t, float>* idx;
   
   if (!enif_get_int(env, argv[0], &f))
     return enif_make_badarg(env);
 
-  if(!enif_is_atom(env, argv[1]))
+  if(!(get_option(env, argv[2], ATOMS.a_dtype, &dtype) &&
+       (enif_is_identical(dtype, ATOMS.a_float32) || enif_is_identical(dtype, ATOMS.a_float16) ||
+        enif_is_identical(dtype, ATOMS.a_bfloat16))))
+    return enif_make_badarg(env);
+
+  if(!(enif_is_atom(env, argv[1]) && (idx = make_index(argv[1], f))))
     return enif_make_badarg(env);
 
   ex_annoy* handle = (ex_annoy*)enif_alloc_resource(ANNOY_INDEX_RESOURCE, sizeof(ex_annoy));
+  new (handle) ex_annoy();
   handle->f = f;
-
-  if(enif_is_identical(argv[1], ATOMS.a_dot)) {
-    handle->idx = new AnnoyIndexDotProduct(f);
-  } else if(enif_is_identical(argv[1], ATOMS.a_euclidean)) {
-    handle->idx = new AnnoyIndexEuclidean(f);
-  } else if(enif_is_identical(argv[1], ATOMS.a_manhattan)) {
-    handle->idx = new AnnoyIndexManhattan(f);
-  } else if(enif_is_identical(argv[1], ATOMS.a_angular)) {
-    handle->idx = new AnnoyIndexAngular(f);
-  } else {
-    return enif_make_badarg(env);
-  }
+  handle->metric = argv[1];
+  handle->dtype = dtype;
+  handle->verbose = false;
+  handle->idx.reset(idx);
+  handle->lock = enif_rwlock_create((char*)"annoy_index");
 
   ERL_NIF_TERM result = enif_make_resource(env, handle);
   enif_release_resource(handle);
@@ -234,7 +992,7 @@ ERL_NIF_TERM annoy_load(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
 
       return enif_make_badarg(env);
     } else {
-      if(!handle->idx->load(file.c_str(), prefault, &error)) {
+      if(!swap_index(handle, file.c_str(), prefault, &error)) {
         ret = error_tuple(env, error); 
         free(error);
       }
@@ -243,6 +1001,10 @@ ERL_NIF_TERM annoy_load(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     }
 }
 
+ERL_NIF_TERM annoy_swap(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  return annoy_load(env, argc, argv);
+}
+
 ERL_NIF_TERM annoy_save(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     ex_annoy* handle;
     std::string file;
@@ -255,91 +1017,414 @@ ERL_NIF_TERM annoy_save(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
          get_boolean(argv[2], &prefault))) {
 
       return enif_make_badarg(env);
-    } else {
-      if(!handle->idx->save(file.c_str(), prefault, &error)) {
-        ret = error_tuple(env, error); 
-        free(error);
+    } else {
+      write_lock lock(handle);
+
+      if(!save_index(handle, file.c_str(), prefault, &error)) {
+        ret = error_tuple(env, error); 
+        free(error);
+      }
+ 
+      return ret;
+    }
+}
+
+ERL_NIF_TERM annoy_save_quantized(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ex_annoy* handle;
+    std::string file, vectors;
+    ERL_NIF_TERM opt = ATOMS.a_false, pq_opt = enif_make_int(env, 0), dtype = ATOMS.a_int8;
+    int subvectors;
+    AnnoyElementType element;
+    char *error;
+    ERL_NIF_TERM ret = ATOMS.a_ok;
+
+    if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+         get_string(env, argv[1], &file) &&
+         get_option(env, argv[2], ATOMS.a_vectors, &opt) &&
+         (enif_is_identical(opt, ATOMS.a_false) || get_string(env, opt, &vectors)) &&
+         get_option(env, argv[2], ATOMS.a_pq, &pq_opt) &&
+         enif_get_int(env, pq_opt, &subvectors) && subvectors >= 0 &&
+         get_option(env, argv[2], ATOMS.a_dtype, &dtype) &&
+         get_quantized_element(dtype, &element))) {
+
+      return enif_make_badarg(env);
+    } else {
+      read_lock lock(handle);
+      annoy_index_ptr idx = current_index(handle);
+      const char* vectors_file = vectors.empty() ? NULL : vectors.c_str();
+
+      if(!(subvectors ? idx->save_pq(file.c_str(), subvectors, vectors_file, &error)
+                      : idx->save_quantized(file.c_str(), element, vectors_file, &error))) {
+        ret = error_tuple(env, error);
+        free(error);
+      }
+
+      return ret;
+    }
+}
+
+// Replaces the index with the quantized one in file.  Unlike load, every
+// handle maps its own copy.
+ERL_NIF_TERM annoy_load_quantized(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ex_annoy* handle;
+    std::string file, vectors;
+    ERL_NIF_TERM vectors_opt = ATOMS.a_false, rerank_opt = enif_make_int(env, 4), prefault_opt = ATOMS.a_false;
+    int rerank;
+    bool prefault;
+    char *error;
+
+    if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+         get_string(env, argv[1], &file) &&
+         get_option(env, argv[2], ATOMS.a_vectors, &vectors_opt) &&
+         (enif_is_identical(vectors_opt, ATOMS.a_false) || get_string(env, vectors_opt, &vectors)) &&
+         get_option(env, argv[2], ATOMS.a_rerank, &rerank_opt) &&
+         enif_get_int(env, rerank_opt, &rerank) && rerank >= 1 &&
+         get_option(env, argv[2], ATOMS.a_prefault, &prefault_opt) &&
+         get_boolean(prefault_opt, &prefault))) {
+
+      return enif_make_badarg(env);
+    }
+
+    // the element type the file was saved with picks the index to load it.
+    AnnoyQuantizedHeader header;
+    std::shared_ptr<AnnoyQuantizedIndexInterface<int32_t, float> > idx;
+
+    if(read_quantized_header(file.c_str(), &header, &error)) {
+      switch(header.element) {
+      case ANNOYLIB_ELEMENT_FLOAT16:
+        idx.reset(make_quantized_index<annoy_float16>(handle->metric, handle->f));
+        break;
+      case ANNOYLIB_ELEMENT_BFLOAT16:
+        idx.reset(make_quantized_index<annoy_bfloat16>(handle->metric, handle->f));
+        break;
+      case ANNOYLIB_ELEMENT_FLOAT32:
+        idx.reset(make_quantized_index<float>(handle->metric, handle->f));
+        break;
+      default:
+        idx.reset(make_quantized_index<int8_t>(handle->metric, handle->f));
       }
- 
+    } else {
+      ERL_NIF_TERM ret = error_tuple(env, error);
+      free(error);
       return ret;
     }
+
+    idx->verbose(handle->verbose);
+    idx->set_rerank_factor(rerank);
+
+    if(!(idx->load(file.c_str(), prefault, &error) &&
+         (vectors.empty() || idx->load_vectors(vectors.c_str(), prefault, &error)))) {
+      ERL_NIF_TERM ret = error_tuple(env, error);
+      free(error);
+      return ret;
+    }
+
+    std::atomic_store(&handle->idx, annoy_index_ptr(idx));
+    return ATOMS.a_ok;
 }
 
 ERL_NIF_TERM annoy_get_nns_by_item(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
   ex_annoy* handle;
   int32_t item, n, search_k;
-  bool include_distances;
+  bool include_distances, packed = false;
   
   if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
        enif_get_int(env, argv[1], &item) &&
        enif_get_int(env, argv[2], &n) &&
        enif_get_int(env, argv[3], &search_k) &&
-       get_boolean(argv[4], &include_distances))) {
+       get_boolean(argv[4], &include_distances) &&
+       get_format(env, argv[5], &packed))) {
 
     return enif_make_badarg(env);
   }
 
-  if(!check_constraints(handle, item, false))
+  // the scheduler thread's buffers, so that queries don't allocate.
+  AnnoyQueryContext<int32_t, float>& context = AnnoyQueryContext<int32_t, float>::local();
+  AnnoyQueryState<int32_t, float>* state = context.reuse();
+  query_filter filter;
+
+  if(!get_filter(env, argv[5], &filter, state))
     return enif_make_badarg(env);
 
-  // the results from the annoy function.
-  vector<int32_t> result;
-  vector<float> distances;
+  annoy_index_ptr idx = current_index(handle);
+  read_lock lock(handle);
 
-  handle->idx->get_nns_by_item(item, n, search_k, &result, include_distances ? &distances : NULL);
+  if(!lock.held)
+    return retry_later(env, "get_nns_by_item", annoy_get_nns_by_item, argc, argv);
 
-  return nns_to_ex(env, result, distances, include_distances);
+  if(!check_constraints(idx.get(), item, false))
+    return enif_make_badarg(env);
+
+  idx->query_begin_by_item(state, item, n, search_k);
+
+  if(!advance_query(env, idx.get(), state)) {
+    context.query_vector.resize(handle->f);
+    idx->get_item(item, &context.query_vector[0]);
+    return yield_query(env, handle, idx, state, &context.query_vector[0], n, search_k, &filter, include_distances, packed);
+  }
+
+  return finish_query(env, idx.get(), state, include_distances, packed);
 }
 
 ERL_NIF_TERM annoy_get_nns_by_vector(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
   ex_annoy* handle;
-  // the vector to search by and item from it.
-  ERL_NIF_TERM v, item;
-  unsigned int arity;
   int32_t n, search_k;
-  bool include_distances;
+  bool include_distances, packed = false;
 
   if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
-       enif_get_list_length(env, argv[1], &arity) &&
        enif_get_int(env, argv[2], &n) &&
        enif_get_int(env, argv[3], &search_k) &&
-       get_boolean(argv[4], &include_distances))) {
+       get_boolean(argv[4], &include_distances) &&
+       get_format(env, argv[5], &packed))) {
 
     return enif_make_badarg(env);
   }
 
-  if((unsigned)handle->f != arity) {
-    enif_fprintf(stderr, "Vector has wrong length (expected %d, got %d)\n", handle->f, arity);
+  // the scheduler thread's buffers, so that queries don't allocate.
+  AnnoyQueryContext<int32_t, float>& context = AnnoyQueryContext<int32_t, float>::local();
+  AnnoyQueryState<int32_t, float>* state = context.reuse();
+
+  // vector to search for.
+  const float* v;
+
+  if(!get_vector(env, argv[1], handle->f, &context.query_vector, &v))
+    return enif_make_badarg(env);
+
+  query_filter filter;
+
+  if(!get_filter(env, argv[5], &filter, state))
+    return enif_make_badarg(env);
+
+  annoy_index_ptr idx = current_index(handle);
+  read_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_nns_by_vector", annoy_get_nns_by_vector, argc, argv);
+
+  idx->query_begin_by_vector(state, v, n, search_k);
+
+  if(!advance_query(env, idx.get(), state))
+    return yield_query(env, handle, idx, state, v, n, search_k, &filter, include_distances, packed);
+
+  return finish_query(env, idx.get(), state, include_distances, packed);
+}
+
+ERL_NIF_TERM annoy_get_nns_by_vectors(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+  int32_t n, search_k, n_threads = -1;
+  bool include_distances = true, packed = true;
+  ERL_NIF_TERM opt;
+
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       enif_get_int(env, argv[2], &n) &&
+       enif_get_int(env, argv[3], &search_k))) {
+
     return enif_make_badarg(env);
   }
 
-  // vector to search for.
-  vector<float> w(handle->f);
-  v = argv[1];
+  opt = ATOMS.a_true;
+  if(!(get_option(env, argv[4], ATOMS.a_include_distances, &opt) && get_boolean(opt, &include_distances)))
+    return enif_make_badarg(env);
 
-  for(unsigned int i=0; i<arity; i++) {
-    double d;
+  opt = enif_make_int(env, n_threads);
+  if(!(get_option(env, argv[4], ATOMS.a_n_threads, &opt) && enif_get_int(env, opt, &n_threads)))
+    return enif_make_badarg(env);
 
-    if(!enif_get_list_cell(env, v, &item, &v)) {
-      enif_fprintf(stderr, "Could not get list item.\n");
-      return enif_make_badarg(env);
+  if(!get_format(env, argv[4], &packed))
+    return enif_make_badarg(env);
+
+  // applies to every row.
+  AnnoyQueryState<int32_t, float> filtered;
+  query_filter filter;
+
+  if(!get_filter(env, argv[4], &filter, &filtered))
+    return enif_make_badarg(env);
+
+  // the queries, one per row.
+  vector<float> w;
+  const float* v;
+  size_t rows;
+
+  if(!get_matrix(env, argv[1], handle->f, &w, &v, &rows))
+    return enif_make_badarg(env);
+
+  vector<vector<int32_t> > results(rows);
+  vector<vector<float> > distances(rows);
+  annoy_index_ptr idx = current_index(handle);
+  int f = handle->f;
+
+  {
+    read_lock lock(handle);
+
+    // rows are run in the order of their paths down the first tree, so that
+    // rows run together, and one after the other, mostly visit the same
+    // nodes and items while they are in cache.
+    vector<pair<uint64_t, size_t> > order(rows);
+    for(size_t i = 0; i < rows; i++)
+      order[i].second = i;
+
+    if(rows > QUERY_GROUP_ROWS) {
+      fan_out(rows, n_threads, [&](size_t i) {
+        order[i].first = idx->get_query_path(v + i * f);
+      });
+      std::sort(order.begin(), order.end());
     }
-    
-    bool ret = get_vector_item(env, item, &d);
-    if(!ret) {
-      enif_fprintf(stderr, "Could not convert vector item to double.\n");
-      return enif_make_badarg(env);
+
+    // each thread takes a group of rows at a time and runs them together,
+    // see query_advance_all.
+    size_t groups = (rows + QUERY_GROUP_ROWS - 1) / QUERY_GROUP_ROWS;
+
+    fan_out(groups, n_threads, [&](size_t g) {
+      size_t first = g * QUERY_GROUP_ROWS, count = std::min((size_t)QUERY_GROUP_ROWS, rows - first);
+      AnnoyQueryState<int32_t, float>** states = AnnoyQueryContext<int32_t, float>::local().reuse_batch(count);
+
+      for(size_t k = 0; k < count; k++) {
+        states[k]->filter = filtered.filter;
+        states[k]->filter_size = filtered.filter_size;
+        states[k]->filter_deny = filtered.filter_deny;
+        idx->query_begin_by_vector(states[k], v + order[first + k].second * f, n, search_k);
+      }
+
+      idx->query_advance_all(states, count);
+
+      for(size_t k = 0; k < count; k++) {
+        size_t i = order[first + k].second;
+        idx->query_finish(states[k], &results[i], include_distances ? &distances[i] : NULL);
+      }
+    });
+  }
+
+  vector<ERL_NIF_TERM> terms(rows);
+  for(size_t i = 0; i < rows; i++)
+    terms[i] = packed ? nns_to_packed(env, results[i], distances[i], include_distances)
+                      : nns_to_ex(env, results[i], distances[i], include_distances);
+
+  return enif_make_list_from_array(env, rows ? &terms[0] : NULL, rows);
+}
+
+// Merges the results of several queries into the n closest, shifting the ids
+// of each by its offset.  False if a shifted id does not fit an int32.
+bool merge_nns(const vector<vector<int32_t> >& results, const vector<vector<float> >& distances,
+               const vector<int64_t>& offsets, size_t n,
+               vector<int32_t>* merged, vector<float>* merged_distances) {
+  // max-heap of the n closest so far, the farthest of them on top.
+  vector<pair<float, int32_t> > top;
+  top.reserve(n);
+
+  for(size_t s = 0; s < results.size(); s++) {
+    for(size_t i = 0; i < results[s].size(); i++) {
+      int64_t id = results[s][i] + offsets[s];
+      if(id < 0 || id > INT32_MAX)
+        return false;
+
+      pair<float, int32_t> item(distances[s][i], (int32_t)id);
+
+      if(top.size() < n) {
+        top.push_back(item);
+        std::push_heap(top.begin(), top.end());
+      } else if(n > 0 && item < top.front()) {
+        std::pop_heap(top.begin(), top.end());
+        top.back() = item;
+        std::push_heap(top.begin(), top.end());
+      } else {
+        // each shard's results come closest first, the rest are no closer.
+        break;
+      }
     }
+  }
+
+  std::sort_heap(top.begin(), top.end());
+
+  for(size_t i = 0; i < top.size(); i++) {
+    merged_distances->push_back(top[i].first);
+    merged->push_back(top[i].second);
+  }
+
+  return true;
+}
+
+ERL_NIF_TERM annoy_get_nns_multi(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  int32_t n, search_k, n_threads = -1;
+  bool include_distances = true, packed = false;
+  unsigned shards;
+  ERL_NIF_TERM opt, list, head;
+
+  if(!(enif_get_list_length(env, argv[0], &shards) && shards > 0 &&
+       enif_get_int(env, argv[2], &n) && n >= 0 &&
+       enif_get_int(env, argv[3], &search_k))) {
+
+    return enif_make_badarg(env);
+  }
+
+  opt = ATOMS.a_true;
+  if(!(get_option(env, argv[4], ATOMS.a_include_distances, &opt) && get_boolean(opt, &include_distances)))
+    return enif_make_badarg(env);
+
+  opt = enif_make_int(env, n_threads);
+  if(!(get_option(env, argv[4], ATOMS.a_n_threads, &opt) && enif_get_int(env, opt, &n_threads)))
+    return enif_make_badarg(env);
+
+  if(!get_format(env, argv[4], &packed))
+    return enif_make_badarg(env);
+
+  // the shards, all of the same metric and number of dimensions.
+  vector<ex_annoy*> handles(shards);
+
+  list = argv[0];
+  for(unsigned i = 0; enif_get_list_cell(env, list, &head, &list); i++) {
+    if(!enif_get_resource(env, head, ANNOY_INDEX_RESOURCE, (void**)&handles[i]))
+      return enif_make_badarg(env);
+
+    if(handles[i]->f != handles[0]->f || !enif_is_identical(handles[i]->metric, handles[0]->metric))
+      return enif_make_badarg(env);
+  }
 
-    w[i] = d;
+  // what to add to the ids found in each shard, none by default.
+  vector<int64_t> offsets(shards, 0);
+
+  opt = 0;
+  if(!get_option(env, argv[4], ATOMS.a_offsets, &opt))
+    return enif_make_badarg(env);
+
+  if(opt) {
+    unsigned length;
+    ErlNifSInt64 offset;
+
+    if(!(enif_get_list_length(env, opt, &length) && length == shards))
+      return enif_make_badarg(env);
+
+    for(unsigned i = 0; enif_get_list_cell(env, opt, &head, &opt); i++) {
+      if(!enif_get_int64(env, head, &offset))
+        return enif_make_badarg(env);
+      offsets[i] = offset;
+    }
   }
 
+  // vector to search for.
+  vector<float> w;
+  const float* v;
+
+  if(!get_vector(env, argv[1], handles[0]->f, &w, &v))
+    return enif_make_badarg(env);
+
+  vector<vector<int32_t> > results(shards);
+  vector<vector<float> > distances(shards);
+
+  fan_out(shards, n_threads, [&](size_t i) {
+    read_lock lock(handles[i]);
+    current_index(handles[i])->get_nns_by_vector(v, n, search_k, &results[i], &distances[i]);
+  });
+
   vector<int32_t> result;
-  vector<float> distances;
-  
-  handle->idx->get_nns_by_vector(&w[0], n, search_k, &result, include_distances ? &distances : NULL);
+  vector<float> result_distances;
+
+  if(!merge_nns(results, distances, offsets, n, &result, &result_distances))
+    return enif_make_badarg(env);
 
-  return nns_to_ex(env, result, distances, include_distances);  
+  if(packed)
+    return nns_to_packed(env, result, result_distances, include_distances);
+
+  return nns_to_ex(env, result, result_distances, include_distances);
 }
 
 ERL_NIF_TERM annoy_get_item_vector(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
@@ -353,11 +1438,21 @@ ERL_NIF_TERM annoy_get_item_vector(ErlNifEnv *env, int argc, const ERL_NIF_TERM
     return enif_make_badarg(env);
   }
 
-  if(!check_constraints(handle, item, false))
-    return enif_make_badarg(env);
-
   vector<float> v(handle->f);
-  handle->idx->get_item(item, &v[0]);
+
+  {
+    read_lock lock(handle);
+
+    if(!lock.held)
+      return retry_later(env, "get_item_vector", annoy_get_item_vector, argc, argv);
+
+    annoy_index_ptr idx = current_index(handle);
+
+    if(!check_constraints(idx.get(), item, false))
+      return enif_make_badarg(env);
+
+    idx->get_item(item, &v[0]);
+  }
 
   for(int i=0; i < handle->f; i++) {
     list = enif_make_list_cell(env, enif_make_double(env, v[i]), list);
@@ -379,10 +1474,17 @@ ERL_NIF_TERM annoy_get_distance(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
     return enif_make_badarg(env);
   }
 
-  if (!check_constraints(handle, i, false) || !check_constraints(handle, j, false))
+  read_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_distance", annoy_get_distance, argc, argv);
+
+  annoy_index_ptr idx = current_index(handle);
+
+  if (!check_constraints(idx.get(), i, false) || !check_constraints(idx.get(), j, false))
     return enif_make_badarg(env);
 
-  double d = handle->idx->get_distance(i,j);
+  double d = idx->get_distance(i,j);
 
   return enif_make_double(env, d);
 }
@@ -394,7 +1496,12 @@ ERL_NIF_TERM annoy_get_n_items(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
     return enif_make_badarg(env);
   }
 
-  return enif_make_int(env, handle->idx->get_n_items());
+  read_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_n_items", annoy_get_n_items, argc, argv);
+
+  return enif_make_int(env, current_index(handle)->get_n_items());
 }
 
 ERL_NIF_TERM annoy_get_n_trees(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
@@ -404,49 +1511,172 @@ ERL_NIF_TERM annoy_get_n_trees(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
     return enif_make_badarg(env);
   }
 
-  return enif_make_int(env, handle->idx->get_n_trees());
+  read_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_n_trees", annoy_get_n_trees, argc, argv);
+
+  return enif_make_int(env, current_index(handle)->get_n_trees());
+}
+
+ERL_NIF_TERM annoy_get_layout(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+
+  if(!enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle)) {
+    return enif_make_badarg(env);
+  }
+
+  read_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "get_layout", annoy_get_layout, argc, argv);
+
+  return make_atom(env, current_index(handle)->get_layout() == ANNOYLIB_LAYOUT_BLOCKED ? "blocked" : "build");
+}
+
+ERL_NIF_TERM annoy_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+
+  if(!enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle)) {
+    return enif_make_badarg(env);
+  }
+
+  // no lock needed, the counters are atomics and kept alive by idx.
+  annoy_index_ptr idx = current_index(handle);
+  const AnnoyIndexStats& stats = idx->get_stats();
+  ERL_NIF_TERM latency[AnnoyIndexStats::LATENCY_BUCKETS];
+
+  for(int i = 0; i < AnnoyIndexStats::LATENCY_BUCKETS; i++) {
+    latency[i] = enif_make_uint64(env, AnnoyIndexStats::get(stats.latency[i]));
+  }
+
+  ERL_NIF_TERM keys[] = {
+    make_atom(env, "queries"),
+    make_atom(env, "visited_nodes"),
+    make_atom(env, "distance_evaluations"),
+    make_atom(env, "duplicates"),
+    make_atom(env, "latency_histogram"),
+    make_atom(env, "reallocations"),
+    make_atom(env, "preprocess_us"),
+    make_atom(env, "thread_build_us"),
+    make_atom(env, "roots_copy_us"),
+  };
+  ERL_NIF_TERM values[] = {
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.queries)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.visited_nodes)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.distance_evaluations)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.duplicates)),
+    enif_make_list_from_array(env, latency, AnnoyIndexStats::LATENCY_BUCKETS),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.reallocations)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.preprocess_us)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.thread_build_us)),
+    enif_make_uint64(env, AnnoyIndexStats::get(stats.roots_copy_us)),
+  };
+  ERL_NIF_TERM map;
+
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+  return map;
+}
+
+ERL_NIF_TERM annoy_simd_isa(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  return make_atom(env, annoylib_simd_isa());
 }
 
 ERL_NIF_TERM annoy_add_item(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
   ex_annoy* handle;
-  // the vector to add and item with in it.
-  ERL_NIF_TERM v, item;
-  // size of the list passed in.
-  unsigned int arity;
   // position to add the vector to
   int32_t pos;
   ERL_NIF_TERM ret = ATOMS.a_ok;
   
   if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
-       enif_get_int(env, argv[1], &pos) &&
-       enif_get_list_length(env, argv[2], &arity))) {
+       enif_get_int(env, argv[1], &pos))) {
     
     return enif_make_badarg(env);
   }
 
-  if(!check_constraints(handle, pos, true))
+  if(!check_constraints(NULL, pos, true))
     return enif_make_badarg(env);
 
-  vector<float> w(handle->f);
-  v = argv[2];
-  double d;
+  vector<float> w;
+  const float* v;
 
-  for(unsigned int i=0; i<arity; i++) {
-    if(!enif_get_list_cell(env, v, &item, &v)) {
-      enif_fprintf(stderr, "Could not get list item.\n");
-      return enif_make_badarg(env);
-    }
+  if(!get_vector(env, argv[2], handle->f, &w, &v))
+    return enif_make_badarg(env);
 
-    if(!get_vector_item(env, item, &d)) {
-      enif_fprintf(stderr, "failed to convert item %d to int or double\n", i);
-      return enif_make_badarg(env);
+  write_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "add_item", annoy_add_item, argc, argv);
+
+  char *error;
+  if(!current_index(handle)->add_item(pos, v, &error)) {
+    ret = error_tuple(env, error);
+    free(error);
+  }
+
+  return ret;
+}
+
+ERL_NIF_TERM annoy_add_items(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+  // the packed item ids, if given.
+  ErlNifBinary ids;
+  // first item id when the rows are added as consecutive items.
+  int32_t first = 0;
+  int32_t n_jobs;
+  ERL_NIF_TERM ret = ATOMS.a_ok;
+
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       (enif_get_int(env, argv[1], &first) || enif_inspect_binary(env, argv[1], &ids)) &&
+       enif_get_int(env, argv[3], &n_jobs))) {
+
+    return enif_make_badarg(env);
+  }
+
+  // the matrix is used in place unless it is not suitably aligned.
+  vector<float> w;
+  const float* v;
+  size_t rows;
+
+  if(!get_matrix(env, argv[2], handle->f, &w, &v, &rows))
+    return enif_make_badarg(env);
+
+  bool explicit_ids = enif_is_binary(env, argv[1]);
+
+  if(explicit_ids && ids.size != rows * sizeof(int32_t)) {
+    enif_fprintf(stderr, "Expected %d item ids, got %d bytes\n", (int)rows, (int)ids.size);
+    return enif_make_badarg(env);
+  }
+
+  if(!explicit_ids && (int64_t)first + (int64_t)rows > (int64_t)std::numeric_limits<int32_t>::max()) {
+    enif_fprintf(stderr, "Item index overflows\n");
+    return enif_make_badarg(env);
+  }
+
+  vector<int32_t> items;
+  const int32_t* item_ids = NULL;
+
+  if(explicit_ids) {
+    item_ids = reinterpret_cast<const int32_t*>(ids.data);
+
+    if(ids.size && reinterpret_cast<uintptr_t>(ids.data) % alignof(int32_t)) {
+      items.resize(rows);
+      memcpy(&items[0], ids.data, ids.size);
+      item_ids = &items[0];
     }
 
-    w[i] = d;
+    for(size_t i = 0; i < rows; i++) {
+      if(!check_constraints(NULL, item_ids[i], true))
+        return enif_make_badarg(env);
+    }
+  } else if(!check_constraints(NULL, first, true)) {
+    return enif_make_badarg(env);
   }
 
+  write_lock lock(handle);
+
   char *error;
-  if(!handle->idx->add_item(pos, &w[0], &error)) {
+  if(!current_index(handle)->add_items(item_ids, first, v, rows, n_jobs, &error)) {
     ret = error_tuple(env, error);
     free(error);
   }
@@ -457,13 +1687,24 @@ ERL_NIF_TERM annoy_add_item(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 void annoy_index_dtor(ErlNifEnv* env, void* arg)
 {
     ex_annoy* handle = (ex_annoy*)arg;
-    delete handle->idx;
+    enif_rwlock_destroy(handle->lock);
+    handle->~ex_annoy();
+}
+
+void annoy_query_dtor(ErlNifEnv* env, void* arg)
+{
+    ex_annoy_query* query = (ex_annoy_query*)arg;
+    enif_release_resource(query->handle);
+    if(query->filter_env)
+      enif_free_env(query->filter_env);
+    query->~ex_annoy_query();
 }
 
 int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
 {
     ErlNifResourceFlags flags = (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER);
     ANNOY_INDEX_RESOURCE = enif_open_resource_type(env, "Elixir.AnnoyEx", "annoy_index_resource", &annoy_index_dtor, flags, 0);
+    ANNOY_QUERY_RESOURCE = enif_open_resource_type(env, "Elixir.AnnoyEx", "annoy_query_resource", &annoy_query_dtor, flags, 0);
 
     ATOMS.a_ok = make_atom(env, "ok");
     ATOMS.a_err = make_atom(env, "err");
@@ -473,6 +1714,23 @@ int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
     ATOMS.a_manhattan = make_atom(env, "manhattan");
     ATOMS.a_dot = make_atom(env, "dot");
     ATOMS.a_angular = make_atom(env, "angular");
+    ATOMS.a_include_distances = make_atom(env, "include_distances");
+    ATOMS.a_n_threads = make_atom(env, "n_threads");
+    ATOMS.a_format = make_atom(env, "format");
+    ATOMS.a_list = make_atom(env, "list");
+    ATOMS.a_packed = make_atom(env, "packed");
+    ATOMS.a_allow = make_atom(env, "allow");
+    ATOMS.a_deny = make_atom(env, "deny");
+    ATOMS.a_offsets = make_atom(env, "offsets");
+    ATOMS.a_vectors = make_atom(env, "vectors");
+    ATOMS.a_rerank = make_atom(env, "rerank");
+    ATOMS.a_prefault = make_atom(env, "prefault");
+    ATOMS.a_dtype = make_atom(env, "dtype");
+    ATOMS.a_int8 = make_atom(env, "int8");
+    ATOMS.a_float32 = make_atom(env, "float32");
+    ATOMS.a_float16 = make_atom(env, "float16");
+    ATOMS.a_bfloat16 = make_atom(env, "bfloat16");
+    ATOMS.a_pq = make_atom(env, "pq");
     
     return 0;
 }
@@ -490,7 +1748,8 @@ ERL_NIF_TERM annoy_build(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     return enif_make_badarg(env);
   }
 
-  bool res = handle->idx->build(n_trees, n_jobs, &error);
+  write_lock lock(handle);
+  bool res = current_index(handle)->build(n_trees, n_jobs, &error);
 
   if(!res) {
     ret = error_tuple(env, error);
@@ -509,7 +1768,12 @@ ERL_NIF_TERM annoy_unbuild(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_badarg(env);
   }
 
-  if(!handle->idx->unbuild(&error)) {
+  write_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "unbuild", annoy_unbuild, argc, argv);
+
+  if(!current_index(handle)->unbuild(&error)) {
     ret = error_tuple(env, error);
     free(error);
   }
@@ -524,7 +1788,7 @@ ERL_NIF_TERM annoy_unload(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     return enif_make_badarg(env);
   }
   
-  handle->idx->unload();
+  swap_index(handle, NULL, false, NULL);
 
   return ATOMS.a_ok;
 }
@@ -533,12 +1797,18 @@ ERL_NIF_TERM annoy_verbose(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
   ex_annoy* handle;
   bool verbose;
   
-  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle)) &&
-     get_boolean(argv[1], &verbose)) {
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       get_boolean(argv[1], &verbose))) {
     return enif_make_badarg(env);
   }
 
-  handle->idx->verbose(verbose);
+  write_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "verbose", annoy_verbose, argc, argv);
+
+  handle->verbose = verbose;
+  current_index(handle)->verbose(verbose);
 
   return ATOMS.a_ok;
 }
@@ -552,7 +1822,12 @@ ERL_NIF_TERM annoy_set_seed(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     return enif_make_badarg(env);
   }
   
-  handle->idx->set_seed(q);
+  write_lock lock(handle);
+
+  if(!lock.held)
+    return retry_later(env, "set_seed", annoy_set_seed, argc, argv);
+
+  current_index(handle)->set_seed(q);
 
   return ATOMS.a_ok;
 }
@@ -568,10 +1843,94 @@ ERL_NIF_TERM annoy_on_disk_build(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
     return enif_make_badarg(env);
   }
 
-  if(!handle->idx->on_disk_build(file.c_str(), &error)) {
+  AnnoyElementType element;
+  if(get_half_element(handle, &element))
+    return error_tuple(env, "You can't build a float16 or bfloat16 index on disk");
+
+  write_lock lock(handle);
+
+  if(!current_index(handle)->on_disk_build(file.c_str(), &error)) {
     ret = error_tuple(env, error);
     free(error);
   }
 
   return ret;
 }
+
+ERL_NIF_TERM annoy_build_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+  int32_t n_trees, n_jobs;
+
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       enif_get_int(env, argv[1], &n_trees) &&
+       enif_get_int(env, argv[2], &n_jobs))) {
+
+    return enif_make_badarg(env);
+  }
+
+  return run_async(env, handle, [handle, n_trees, n_jobs](ErlNifEnv* msg_env) {
+    char *error;
+    ERL_NIF_TERM ret = ATOMS.a_ok;
+
+    write_lock lock(handle);
+
+    if(!current_index(handle)->build(n_trees, n_jobs, &error)) {
+      ret = error_tuple(msg_env, error);
+      free(error);
+    }
+
+    return ret;
+  });
+}
+
+ERL_NIF_TERM annoy_save_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+  std::string file;
+  bool prefault;
+
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       get_string(env, argv[1], &file) &&
+       get_boolean(argv[2], &prefault))) {
+
+    return enif_make_badarg(env);
+  }
+
+  return run_async(env, handle, [handle, file, prefault](ErlNifEnv* msg_env) {
+    char *error;
+    ERL_NIF_TERM ret = ATOMS.a_ok;
+
+    write_lock lock(handle);
+
+    if(!save_index(handle, file.c_str(), prefault, &error)) {
+      ret = error_tuple(msg_env, error);
+      free(error);
+    }
+
+    return ret;
+  });
+}
+
+ERL_NIF_TERM annoy_load_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  ex_annoy* handle;
+  std::string file;
+  bool prefault;
+
+  if(!(enif_get_resource(env, argv[0], ANNOY_INDEX_RESOURCE, (void**)&handle) &&
+       get_string(env, argv[1], &file) &&
+       get_boolean(argv[2], &prefault))) {
+
+    return enif_make_badarg(env);
+  }
+
+  return run_async(env, handle, [handle, file, prefault](ErlNifEnv* msg_env) {
+    char *error;
+    ERL_NIF_TERM ret = ATOMS.a_ok;
+
+    if(!swap_index(handle, file.c_str(), prefault, &error)) {
+      ret = error_tuple(msg_env, error);
+      free(error);
+    }
+
+    return ret;
+  });
+}
@@ -57,6 +57,8 @@ typedef signed __int64    int64_t;
 #include <algorithm>
 #include <queue>
 #include <limits>
+#include <atomic>
+#include <chrono>
 
 #if __cplusplus >= 201103L
 #include <type_traits>
@@ -65,7 +67,9 @@ typedef signed __int64    int64_t;
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
 #include <thread>
 #include <mutex>
-#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #endif
 
 #ifdef _MSC_VER
@@ -91,6 +95,12 @@ typedef signed __int64    int64_t;
   # include <alloca.h>
 #endif
 
+#ifdef __GNUC__
+#define ANNOYLIB_PREFETCH(p) __builtin_prefetch((p))
+#else
+#define ANNOYLIB_PREFETCH(p) ((void)(p))
+#endif
+
 // We let the v array in the Node struct take whatever space is needed, so this is a mostly insignificant number.
 // Compilers need *some* size defined for the v array, and some memory checking tools will flag for buffer overruns if this is set too low.
 #define ANNOYLIB_V_ARRAY_SIZE 65536
@@ -105,10 +115,13 @@ typedef signed __int64    int64_t;
 #define ANNOYLIB_USE_AVX512
 #elif !defined(NO_MANUAL_VECTORIZATION) && defined(__AVX__) && defined (__SSE__) && defined(__SSE2__) && defined(__SSE3__)
 #define ANNOYLIB_USE_AVX
+#elif !defined(NO_MANUAL_VECTORIZATION) && defined(__GNUC__) && defined(__x86_64__)
+// Not built for a particular CPU: pick the kernels at runtime instead.
+#define ANNOYLIB_RUNTIME_DISPATCH
 #else
 #endif
 
-#if defined(ANNOYLIB_USE_AVX) || defined(ANNOYLIB_USE_AVX512)
+#if defined(ANNOYLIB_USE_AVX) || defined(ANNOYLIB_USE_AVX512) || defined(ANNOYLIB_RUNTIME_DISPATCH)
 #if defined(_MSC_VER)
 #include <intrin.h>
 #elif defined(__GNUC__)
@@ -162,6 +175,80 @@ inline bool remap_memory_and_truncate(void** _ptr, int _fd, size_t old_size, siz
     return ok;
 }
 
+// IEEE half precision and bfloat16 values, kept as their bits. Unlike the
+// kernels below they are not in the anonymous namespace, as the public
+// AnnoyCodec and AnnoyQuantizedIndex templates are instantiated with them.
+struct annoy_float16 {
+  uint16_t bits;
+};
+
+struct annoy_bfloat16 {
+  uint16_t bits;
+};
+
+inline float float16_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // subnormal, normalized as a float.
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+// Rounds to nearest even, like F16C does.
+inline uint16_t float_to_float16(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+  if (bits > 0x7f800000)
+    return sign | 0x7e00;
+  if (bits >= 0x477ff000) // rounds to more than 65504
+    return sign | 0x7c00;
+  if (bits < 0x38800000) {
+    // a subnormal half: adding 0.5 leaves the float an ulp of 2^-24.
+    float y;
+    memcpy(&y, &bits, sizeof(y));
+    y += 0.5f;
+    memcpy(&bits, &y, sizeof(bits));
+    return sign | (uint16_t)(bits - 0x3f000000);
+  }
+  bits += 0xc8000fff + ((bits >> 13) & 1);
+  return sign | (uint16_t)(bits >> 13);
+}
+
+inline float bfloat16_to_float(uint16_t b) {
+  uint32_t bits = (uint32_t)b << 16;
+  float x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+inline uint16_t float_to_bfloat16(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000)
+    return (bits >> 16) | 0x40;
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
 namespace {
 
 template<typename S, typename Node>
@@ -201,6 +288,37 @@ inline T euclidean_distance(const T* x, const T* y, int f) {
   return d;
 }
 
+// Dimensions summed between checks of a bounded distance against its bound.
+// A multiple of 16, so that every kernel checks after whole vectors.
+#ifndef ANNOYLIB_ABANDON_DIMS
+#define ANNOYLIB_ABANDON_DIMS 32
+#endif
+
+// The distance, or once the sum so far exceeds bound, that partial sum:
+// something larger than bound but no more than the distance.
+template<typename T>
+inline T euclidean_distance_bounded(const T* x, const T* y, int f, T bound) {
+  T d = 0.0;
+  for (int i = 0; i < f; ++i) {
+    const T tmp = x[i] - y[i];
+    d += tmp * tmp;
+    if ((i + 1) % ANNOYLIB_ABANDON_DIMS == 0 && d > bound)
+      break;
+  }
+  return d;
+}
+
+template<typename T>
+inline T manhattan_distance_bounded(const T* x, const T* y, int f, T bound) {
+  T d = 0.0;
+  for (int i = 0; i < f; i++) {
+    d += fabs(x[i] - y[i]);
+    if ((i + 1) % ANNOYLIB_ABANDON_DIMS == 0 && d > bound)
+      break;
+  }
+  return d;
+}
+
 #ifdef ANNOYLIB_USE_AVX
 // Horizontal single sum of 256bit vector.
 inline float hsum256_ps_avx(__m256 v) {
@@ -282,6 +400,60 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
+template<>
+inline float manhattan_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  int i = f;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (int z = 8; i > 7; i -= 8, z += 8) {
+      const __m256 x_minus_y = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      const __m256 distance = _mm256_andnot_ps(minus_zero, x_minus_y); // Absolute value of x_minus_y (forces sign bit to zero)
+      manhattan = _mm256_add_ps(manhattan, distance);
+      x += 8;
+      y += 8;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum256_ps_avx(manhattan)) > bound)
+        return result;
+    }
+    // Sum all floats in manhattan register.
+    result = hsum256_ps_avx(manhattan);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+template<>
+inline float euclidean_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  float result=0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (int z = 8; f > 7; f -= 8, z += 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      d = _mm256_add_ps(d, _mm256_mul_ps(diff, diff)); // no support for fmadd in AVX...
+      x += 8;
+      y += 8;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum256_ps_avx(d)) > bound)
+        return result;
+    }
+    // Sum all floats in dot register.
+    result = hsum256_ps_avx(d);
+  }
+  // Don't forget the remaining values.
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
 #endif
 
 #ifdef ANNOYLIB_USE_AVX512
@@ -356,1138 +528,4207 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
+template<>
+inline float manhattan_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  int i = f;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    for (int z = 16; i > 15; i -= 16, z += 16) {
+      const __m512 x_minus_y = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(x_minus_y));
+      x += 16;
+      y += 16;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = _mm512_reduce_add_ps(manhattan)) > bound)
+        return result;
+    }
+    // Sum all floats in manhattan register.
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  // Don't forget the remaining values.
+  for (; i > 0; i--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+template<>
+inline float euclidean_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  float result=0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (int z = 16; f > 15; f -= 16, z += 16) {
+      const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      y += 16;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = _mm512_reduce_add_ps(d)) > bound)
+        return result;
+    }
+    // Sum all floats in dot register.
+    result = _mm512_reduce_add_ps(d);
+  }
+  // Don't forget the remaining values.
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
 #endif
 
- 
-template<typename T>
-inline T get_norm(T* v, int f) {
-  return sqrt(dot(v, v, f));
+// Kernels for int8 codes against a float query, see AnnoyQuantizedIndex.
+// The codes stand for offset + scale * code.
+inline float dot_i8_scalar(const float* x, const int8_t* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += x[i] * c[i];
+  return result;
 }
 
-template<typename T, typename Random, typename Distance, typename Node>
-inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
-  /*
-    This algorithm is a huge heuristic. Empirically it works really well, but I
-    can't motivate it well. The basic idea is to keep two centroids and assign
-    points to either one of them. We weight each centroid by the number of points
-    assigned to it, so to balance it. 
-  */
-  static int iteration_steps = 200;
-  size_t count = nodes.size();
+inline float manhattan_distance_i8_scalar(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += fabsf(x[i] - offset - scale * c[i]);
+  return result;
+}
 
-  size_t i = random.index(count);
-  size_t j = random.index(count-1);
-  j += (j >= i); // ensure that i != j
+inline float euclidean_distance_i8_scalar(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++) {
+    float tmp = x[i] - offset - scale * c[i];
+    result += tmp * tmp;
+  }
+  return result;
+}
 
-  Distance::template copy_node<T, Node>(p, nodes[i], f);
-  Distance::template copy_node<T, Node>(q, nodes[j], f);
+// Kernels for half precision vectors against a float query, accumulating in
+// float.
+inline float dot_f16_scalar(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += x[i] * float16_to_float(c[i].bits);
+  return result;
+}
 
-  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
-  Distance::init_node(p, f);
-  Distance::init_node(q, f);
+inline float manhattan_distance_f16_scalar(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += fabsf(x[i] - float16_to_float(c[i].bits));
+  return result;
+}
 
-  int ic = 1, jc = 1;
-  for (int l = 0; l < iteration_steps; l++) {
-    size_t k = random.index(count);
-    T di = ic * Distance::distance(p, nodes[k], f),
-      dj = jc * Distance::distance(q, nodes[k], f);
-    T norm = cosine ? get_norm(nodes[k]->v, f) : 1;
-    if (!(norm > T(0))) {
-      continue;
-    }
-    if (di < dj) {
-      for (int z = 0; z < f; z++)
-        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
-      Distance::init_node(p, f);
-      ic++;
-    } else if (dj < di) {
-      for (int z = 0; z < f; z++)
-        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
-      Distance::init_node(q, f);
-      jc++;
-    }
+inline float euclidean_distance_f16_scalar(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++) {
+    float tmp = x[i] - float16_to_float(c[i].bits);
+    result += tmp * tmp;
   }
+  return result;
 }
-} // namespace
 
-struct Base {
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // Override this in specific metric structs below if you need to do any pre-processing
-    // on the entire set of nodes passed into this index.
+inline float dot_bf16_scalar(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += x[i] * bfloat16_to_float(c[i].bits);
+  return result;
+}
+
+inline float manhattan_distance_bf16_scalar(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += fabsf(x[i] - bfloat16_to_float(c[i].bits));
+  return result;
+}
+
+inline float euclidean_distance_bf16_scalar(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  for (int i = 0; i < f; i++) {
+    float tmp = x[i] - bfloat16_to_float(c[i].bits);
+    result += tmp * tmp;
   }
+  return result;
+}
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    // Initialize any fields that require sane defaults within this node.
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+// Kernels for several instruction sets, built with target attributes so that
+// the library itself needs no -m flags, and picked by what the CPU running
+// it supports when the library is loaded.
+
+// Horizontal single sum of 128bit vector.
+__attribute__((target("sse2")))
+inline float hsum128_ps_sse2(__m128 v) {
+  const __m128 x64 = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
+  return _mm_cvtss_f32(x32);
+}
+
+__attribute__((target("sse2")))
+inline float dot_sse2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    for (; f > 3; f -= 4) {
+      d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(y)));
+      x += 4;
+      y += 4;
+    }
+    result = hsum128_ps_sse2(d);
+  }
+  for (; f > 0; f--) {
+    result += *x * *y;
+    x++;
+    y++;
   }
+  return result;
+}
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
+__attribute__((target("sse2")))
+inline float manhattan_distance_sse2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 3) {
+    __m128 manhattan = _mm_setzero_ps();
+    const __m128 minus_zero = _mm_set1_ps(-0.0f);
+    for (; f > 3; f -= 4) {
+      const __m128 x_minus_y = _mm_sub_ps(_mm_loadu_ps(x), _mm_loadu_ps(y));
+      manhattan = _mm_add_ps(manhattan, _mm_andnot_ps(minus_zero, x_minus_y));
+      x += 4;
+      y += 4;
+    }
+    result = hsum128_ps_sse2(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
   }
+  return result;
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = get_norm(node->v, f);
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
+__attribute__((target("sse2")))
+inline float euclidean_distance_sse2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    for (; f > 3; f -= 4) {
+      const __m128 diff = _mm_sub_ps(_mm_loadu_ps(x), _mm_loadu_ps(y));
+      d = _mm_add_ps(d, _mm_mul_ps(diff, diff));
+      x += 4;
+      y += 4;
     }
+    result = hsum128_ps_sse2(d);
   }
-};
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
 
-struct Angular : Base {
-  template<typename S, typename T>
-  struct Node {
+// The bounded kernels sum exactly as the plain ones do, so a distance that
+// isn't abandoned comes out the same.
+__attribute__((target("sse2")))
+inline float manhattan_distance_bounded_sse2(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 3) {
+    __m128 manhattan = _mm_setzero_ps();
+    const __m128 minus_zero = _mm_set1_ps(-0.0f);
+    for (int z = 4; f > 3; f -= 4, z += 4) {
+      const __m128 x_minus_y = _mm_sub_ps(_mm_loadu_ps(x), _mm_loadu_ps(y));
+      manhattan = _mm_add_ps(manhattan, _mm_andnot_ps(minus_zero, x_minus_y));
+      x += 4;
+      y += 4;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum128_ps_sse2(manhattan)) > bound)
+        return result;
+    }
+    result = hsum128_ps_sse2(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("sse2")))
+inline float euclidean_distance_bounded_sse2(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    for (int z = 4; f > 3; f -= 4, z += 4) {
+      const __m128 diff = _mm_sub_ps(_mm_loadu_ps(x), _mm_loadu_ps(y));
+      d = _mm_add_ps(d, _mm_mul_ps(diff, diff));
+      x += 4;
+      y += 4;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum128_ps_sse2(d)) > bound)
+        return result;
+    }
+    result = hsum128_ps_sse2(d);
+  }
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+// Horizontal single sum of 256bit vector.
+__attribute__((target("avx2,fma")))
+inline float hsum256_ps_avx2(__m256 v) {
+  const __m128 x128 = _mm_add_ps(_mm256_extractf128_ps(v, 1), _mm256_castps256_ps128(v));
+  const __m128 x64 = _mm_add_ps(x128, _mm_movehl_ps(x128, x128));
+  const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
+  return _mm_cvtss_f32(x32);
+}
+
+__attribute__((target("avx2,fma")))
+inline float dot_avx2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y), d);
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  for (; f > 0; f--) {
+    result += *x * *y;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline float manhattan_distance_avx2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; f > 7; f -= 8) {
+      const __m256 x_minus_y = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, x_minus_y));
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx2(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline float euclidean_distance_avx2(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline float manhattan_distance_bounded_avx2(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (int z = 8; f > 7; f -= 8, z += 8) {
+      const __m256 x_minus_y = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, x_minus_y));
+      x += 8;
+      y += 8;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum256_ps_avx2(manhattan)) > bound)
+        return result;
+    }
+    result = hsum256_ps_avx2(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline float euclidean_distance_bounded_avx2(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (int z = 8; f > 7; f -= 8, z += 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y));
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      y += 8;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = hsum256_ps_avx2(d)) > bound)
+        return result;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline float dot_i8_avx2(const float* x, const int8_t* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 codes = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)c)));
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), codes, d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + dot_i8_scalar(x, c, f);
+}
+
+__attribute__((target("avx2,fma")))
+inline float manhattan_distance_i8_avx2(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    const __m256 offsets = _mm256_set1_ps(offset);
+    const __m256 scales = _mm256_set1_ps(scale);
+    for (; f > 7; f -= 8) {
+      const __m256 codes = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)c)));
+      const __m256 diff = _mm256_fnmadd_ps(scales, codes, _mm256_sub_ps(_mm256_loadu_ps(x), offsets));
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, diff));
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(manhattan);
+  }
+  return result + manhattan_distance_i8_scalar(x, c, offset, scale, f);
+}
+
+__attribute__((target("avx2,fma")))
+inline float euclidean_distance_i8_avx2(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    const __m256 offsets = _mm256_set1_ps(offset);
+    const __m256 scales = _mm256_set1_ps(scale);
+    for (; f > 7; f -= 8) {
+      const __m256 codes = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)c)));
+      const __m256 diff = _mm256_fnmadd_ps(scales, codes, _mm256_sub_ps(_mm256_loadu_ps(x), offsets));
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + euclidean_distance_i8_scalar(x, c, offset, scale, f);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline float dot_f16_avx2(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 halves = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)c));
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), halves, d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + dot_f16_scalar(x, c, f);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline float manhattan_distance_f16_avx2(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; f > 7; f -= 8) {
+      const __m256 halves = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)c));
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), halves);
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, diff));
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(manhattan);
+  }
+  return result + manhattan_distance_f16_scalar(x, c, f);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline float euclidean_distance_f16_avx2(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 halves = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)c));
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), halves);
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + euclidean_distance_f16_scalar(x, c, f);
+}
+
+// bfloat16 is the upper half of a float, so widening is a shift.
+__attribute__((target("avx2,fma")))
+inline __m256 load_bf16_avx2(const annoy_bfloat16* c) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)c)), 16));
+}
+
+__attribute__((target("avx2,fma")))
+inline float dot_bf16_avx2(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x), load_bf16_avx2(c), d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + dot_bf16_scalar(x, c, f);
+}
+
+__attribute__((target("avx2,fma")))
+inline float manhattan_distance_bf16_avx2(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 manhattan = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), load_bf16_avx2(c));
+      manhattan = _mm256_add_ps(manhattan, _mm256_andnot_ps(minus_zero, diff));
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(manhattan);
+  }
+  return result + manhattan_distance_bf16_scalar(x, c, f);
+}
+
+__attribute__((target("avx2,fma")))
+inline float euclidean_distance_bf16_avx2(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), load_bf16_avx2(c));
+      d = _mm256_fmadd_ps(diff, diff, d);
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_ps_avx2(d);
+  }
+  return result + euclidean_distance_bf16_scalar(x, c, f);
+}
+
+// GCC 12 reports its own AVX-512 intrinsics as using uninitialized values.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+inline float dot_avx512(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      d = _mm512_fmadd_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y), d);
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  for (; f > 0; f--) {
+    result += *x * *y;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+inline float manhattan_distance_avx512(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 x_minus_y = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(x_minus_y));
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_avx512(const float* x, const float* y, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+inline float manhattan_distance_bounded_avx512(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    for (int z = 16; f > 15; f -= 16, z += 16) {
+      const __m512 x_minus_y = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(x_minus_y));
+      x += 16;
+      y += 16;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = _mm512_reduce_add_ps(manhattan)) > bound)
+        return result;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  for (; f > 0; f--) {
+    result += fabsf(*x - *y);
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_bounded_avx512(const float* x, const float* y, int f, float bound) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (int z = 16; f > 15; f -= 16, z += 16) {
+      const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_loadu_ps(y));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      y += 16;
+      if (z % ANNOYLIB_ABANDON_DIMS == 0 && (result = _mm512_reduce_add_ps(d)) > bound)
+        return result;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  for (; f > 0; f--) {
+    float tmp = *x - *y;
+    result += tmp * tmp;
+    x++;
+    y++;
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+inline float dot_i8_avx512(const float* x, const int8_t* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 codes = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)c)));
+      d = _mm512_fmadd_ps(_mm512_loadu_ps(x), codes, d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + dot_i8_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline float manhattan_distance_i8_avx512(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    const __m512 offsets = _mm512_set1_ps(offset);
+    const __m512 scales = _mm512_set1_ps(scale);
+    for (; f > 15; f -= 16) {
+      const __m512 codes = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)c)));
+      const __m512 diff = _mm512_fnmadd_ps(scales, codes, _mm512_sub_ps(_mm512_loadu_ps(x), offsets));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(diff));
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  return result + manhattan_distance_i8_scalar(x, c, offset, scale, f);
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_i8_avx512(const float* x, const int8_t* c, float offset, float scale, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    const __m512 offsets = _mm512_set1_ps(offset);
+    const __m512 scales = _mm512_set1_ps(scale);
+    for (; f > 15; f -= 16) {
+      const __m512 codes = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)c)));
+      const __m512 diff = _mm512_fnmadd_ps(scales, codes, _mm512_sub_ps(_mm512_loadu_ps(x), offsets));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + euclidean_distance_i8_scalar(x, c, offset, scale, f);
+}
+
+__attribute__((target("avx512f")))
+inline float dot_f16_avx512(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 halves = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)c));
+      d = _mm512_fmadd_ps(_mm512_loadu_ps(x), halves, d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + dot_f16_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline float manhattan_distance_f16_avx512(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 halves = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)c));
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x), halves)));
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  return result + manhattan_distance_f16_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_f16_avx512(const float* x, const annoy_float16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)c)));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + euclidean_distance_f16_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline __m512 load_bf16_avx512(const annoy_bfloat16* c) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)c)), 16));
+}
+
+__attribute__((target("avx512f")))
+inline float dot_bf16_avx512(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      d = _mm512_fmadd_ps(_mm512_loadu_ps(x), load_bf16_avx512(c), d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + dot_bf16_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline float manhattan_distance_bf16_avx512(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 manhattan = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      manhattan = _mm512_add_ps(manhattan, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x), load_bf16_avx512(c))));
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(manhattan);
+  }
+  return result + manhattan_distance_bf16_scalar(x, c, f);
+}
+
+__attribute__((target("avx512f")))
+inline float euclidean_distance_bf16_avx512(const float* x, const annoy_bfloat16* c, int f) {
+  float result = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x), load_bf16_avx512(c));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      c += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
+  }
+  return result + euclidean_distance_bf16_scalar(x, c, f);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+struct AnnoyKernels {
+  const char* isa;
+  float (*dot)(const float*, const float*, int);
+  float (*manhattan_distance)(const float*, const float*, int);
+  float (*euclidean_distance)(const float*, const float*, int);
+  float (*manhattan_distance_bounded)(const float*, const float*, int, float);
+  float (*euclidean_distance_bounded)(const float*, const float*, int, float);
+  float (*dot_i8)(const float*, const int8_t*, int);
+  float (*manhattan_distance_i8)(const float*, const int8_t*, float, float, int);
+  float (*euclidean_distance_i8)(const float*, const int8_t*, float, float, int);
+  float (*dot_f16)(const float*, const annoy_float16*, int);
+  float (*manhattan_distance_f16)(const float*, const annoy_float16*, int);
+  float (*euclidean_distance_f16)(const float*, const annoy_float16*, int);
+  float (*dot_bf16)(const float*, const annoy_bfloat16*, int);
+  float (*manhattan_distance_bf16)(const float*, const annoy_bfloat16*, int);
+  float (*euclidean_distance_bf16)(const float*, const annoy_bfloat16*, int);
+};
+
+inline AnnoyKernels annoylib_select_kernels() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    AnnoyKernels k = { "avx512f", dot_avx512, manhattan_distance_avx512, euclidean_distance_avx512,
+                       manhattan_distance_bounded_avx512, euclidean_distance_bounded_avx512,
+                       dot_i8_avx512, manhattan_distance_i8_avx512, euclidean_distance_i8_avx512,
+                       dot_f16_avx512, manhattan_distance_f16_avx512, euclidean_distance_f16_avx512,
+                       dot_bf16_avx512, manhattan_distance_bf16_avx512, euclidean_distance_bf16_avx512 };
+    return k;
+  }
+  // every CPU with AVX2 has F16C as well.
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+    AnnoyKernels k = { "avx2_fma", dot_avx2, manhattan_distance_avx2, euclidean_distance_avx2,
+                       manhattan_distance_bounded_avx2, euclidean_distance_bounded_avx2,
+                       dot_i8_avx2, manhattan_distance_i8_avx2, euclidean_distance_i8_avx2,
+                       dot_f16_avx2, manhattan_distance_f16_avx2, euclidean_distance_f16_avx2,
+                       dot_bf16_avx2, manhattan_distance_bf16_avx2, euclidean_distance_bf16_avx2 };
+    return k;
+  }
+  AnnoyKernels k = { "sse2", dot_sse2, manhattan_distance_sse2, euclidean_distance_sse2,
+                     manhattan_distance_bounded_sse2, euclidean_distance_bounded_sse2,
+                     dot_i8_scalar, manhattan_distance_i8_scalar, euclidean_distance_i8_scalar,
+                     dot_f16_scalar, manhattan_distance_f16_scalar, euclidean_distance_f16_scalar,
+                     dot_bf16_scalar, manhattan_distance_bf16_scalar, euclidean_distance_bf16_scalar };
+  return k;
+}
+
+// Picked once, as the library is loaded.
+static const AnnoyKernels annoylib_kernels = annoylib_select_kernels();
+
+template<>
+inline float dot<float>(const float* x, const float *y, int f) {
+  return annoylib_kernels.dot(x, y, f);
+}
+
+template<>
+inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+  return annoylib_kernels.manhattan_distance(x, y, f);
+}
+
+template<>
+inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+  return annoylib_kernels.euclidean_distance(x, y, f);
+}
+
+template<>
+inline float manhattan_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  return annoylib_kernels.manhattan_distance_bounded(x, y, f, bound);
+}
+
+template<>
+inline float euclidean_distance_bounded<float>(const float* x, const float* y, int f, float bound) {
+  return annoylib_kernels.euclidean_distance_bounded(x, y, f, bound);
+}
+
+#endif
+
+inline float dot_i8(const float* x, const int8_t* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.dot_i8(x, c, f);
+#else
+  return dot_i8_scalar(x, c, f);
+#endif
+}
+
+inline float manhattan_distance_i8(const float* x, const int8_t* c, float offset, float scale, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.manhattan_distance_i8(x, c, offset, scale, f);
+#else
+  return manhattan_distance_i8_scalar(x, c, offset, scale, f);
+#endif
+}
+
+inline float euclidean_distance_i8(const float* x, const int8_t* c, float offset, float scale, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.euclidean_distance_i8(x, c, offset, scale, f);
+#else
+  return euclidean_distance_i8_scalar(x, c, offset, scale, f);
+#endif
+}
+
+inline float dot_f16(const float* x, const annoy_float16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.dot_f16(x, c, f);
+#else
+  return dot_f16_scalar(x, c, f);
+#endif
+}
+
+inline float manhattan_distance_f16(const float* x, const annoy_float16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.manhattan_distance_f16(x, c, f);
+#else
+  return manhattan_distance_f16_scalar(x, c, f);
+#endif
+}
+
+inline float euclidean_distance_f16(const float* x, const annoy_float16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.euclidean_distance_f16(x, c, f);
+#else
+  return euclidean_distance_f16_scalar(x, c, f);
+#endif
+}
+
+inline float dot_bf16(const float* x, const annoy_bfloat16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.dot_bf16(x, c, f);
+#else
+  return dot_bf16_scalar(x, c, f);
+#endif
+}
+
+inline float manhattan_distance_bf16(const float* x, const annoy_bfloat16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.manhattan_distance_bf16(x, c, f);
+#else
+  return manhattan_distance_bf16_scalar(x, c, f);
+#endif
+}
+
+inline float euclidean_distance_bf16(const float* x, const annoy_bfloat16* c, int f) {
+#ifdef ANNOYLIB_RUNTIME_DISPATCH
+  return annoylib_kernels.euclidean_distance_bf16(x, c, f);
+#else
+  return euclidean_distance_bf16_scalar(x, c, f);
+#endif
+}
+
+// The instruction set the float distance kernels use.
+inline const char* annoylib_simd_isa() {
+#if defined(ANNOYLIB_USE_AVX512)
+  return "avx512f";
+#elif defined(ANNOYLIB_USE_AVX)
+  return "avx";
+#elif defined(ANNOYLIB_RUNTIME_DISPATCH)
+  return annoylib_kernels.isa;
+#else
+  return "none";
+#endif
+}
+
+ 
+template<typename T>
+inline T get_norm(T* v, int f) {
+  return sqrt(dot(v, v, f));
+}
+
+template<typename T, typename Random, typename Distance, typename Node>
+inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
+  /*
+    This algorithm is a huge heuristic. Empirically it works really well, but I
+    can't motivate it well. The basic idea is to keep two centroids and assign
+    points to either one of them. We weight each centroid by the number of points
+    assigned to it, so to balance it. 
+  */
+  static int iteration_steps = 200;
+  size_t count = nodes.size();
+
+  size_t i = random.index(count);
+  size_t j = random.index(count-1);
+  j += (j >= i); // ensure that i != j
+
+  Distance::template copy_node<T, Node>(p, nodes[i], f);
+  Distance::template copy_node<T, Node>(q, nodes[j], f);
+
+  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
+  Distance::init_node(p, f);
+  Distance::init_node(q, f);
+
+  int ic = 1, jc = 1;
+  for (int l = 0; l < iteration_steps; l++) {
+    size_t k = random.index(count);
+    T di = ic * Distance::distance(p, nodes[k], f),
+      dj = jc * Distance::distance(q, nodes[k], f);
+    T norm = cosine ? get_norm(nodes[k]->v, f) : 1;
+    if (!(norm > T(0))) {
+      continue;
+    }
+    if (di < dj) {
+      for (int z = 0; z < f; z++)
+        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
+      Distance::init_node(p, f);
+      ic++;
+    } else if (dj < di) {
+      for (int z = 0; z < f; z++)
+        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
+      Distance::init_node(q, f);
+      jc++;
+    }
+  }
+}
+} // namespace
+
+struct Base {
+  template<typename T, typename S, typename Node, typename ThreadedBuildPolicy>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f, ThreadedBuildPolicy& threaded_build_policy) {
+    // Override this in specific metric structs below if you need to do any pre-processing
+    // on the entire set of nodes passed into this index.  Passes over the nodes can be split
+    // across the build threads with threaded_build_policy.parallel_for.
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    // Initialize any fields that require sane defaults within this node.
+  }
+
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    memcpy(dest->v, source->v, f * sizeof(T));
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    T norm = get_norm(node->v, f);
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+    }
+  }
+};
+
+struct Angular : Base {
+  template<typename S, typename T>
+  struct Node {
+    /*
+     * We store a binary tree where each node has two things
+     * - A vector associated with it
+     * - Two children
+     * All nodes occupy the same amount of memory
+     * All nodes with n_descendants == 1 are leaf nodes.
+     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
+     * we skip the vector. Instead we store a list of all descendants. K is
+     * determined by the number of items that fits in the space of the vector.
+     * For nodes with n_descendants == 1 the vector is a data point.
+     * For nodes with n_descendants > K the vector is the normal of the split plane.
+     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
+     * more memory to be able to fit the vector outside
+     */
+    S n_descendants;
+    union {
+      S children[2]; // Will possibly store more than 2
+      T norm;
+    };
+    T v[ANNOYLIB_V_ARRAY_SIZE];
+  };
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    // want to calculate (a/|a| - b/|b|)^2
+    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
+    // = 2 - 2cos
+    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
+    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
+    T pq = dot(x->v, y->v, f);
+    T ppqq = pp * qq;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0; // cos is 0
+  }
+  template<typename S, typename T>
+  static inline T margin(const Node<S, T>* n, const T* y, int f) {
+    return dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    // Used when requesting distances from Python layer
+    // Turns out sometimes the squared distance is -0.0
+    // so we have to make sure it's a positive number.
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+    n->norm = dot(n->v, n->v, f);
+  }
+  static const char* name() {
+    return "angular";
+  }
+};
+
+
+struct DotProduct : Angular {
+  template<typename S, typename T>
+  struct Node {
+    /*
+     * This is an extension of the Angular node with an extra attribute for the scaled norm.
+     */
+    S n_descendants;
+    S children[2]; // Will possibly store more than 2
+    T dot_factor;
+    T v[ANNOYLIB_V_ARRAY_SIZE];
+  };
+
+  static const char* name() {
+    return "dot";
+  }
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return -dot(x->v, y->v, f);
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    dest->dot_factor = 0;
+  }
+
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    memcpy(dest->v, source->v, f * sizeof(T));
+    dest->dot_factor = source->dot_factor;
+  }
+
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    DotProduct::zero_value(p); 
+    DotProduct::zero_value(q);
+    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    n->dot_factor = p->dot_factor - q->dot_factor;
+    DotProduct::normalize<T, Node<S, T> >(n, f);
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+      node->dot_factor /= norm;
+    }
+  }
+
+  template<typename S, typename T>
+  static inline T margin(const Node<S, T>* n, const T* y, int f) {
+    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  }
+
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
+  }
+
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return -distance;
+  }
+
+  template<typename T, typename S, typename Node, typename ThreadedBuildPolicy>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f, ThreadedBuildPolicy& threaded_build_policy) {
+    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
+    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+
+    // Step one: compute the norm of each vector and store that in its extra dimension (f-1),
+    // and find the maximum norm.  Each range of nodes finds its own maximum, then merges it.
+    std::atomic<T> max_norm(0);
+    threaded_build_policy.parallel_for((size_t)node_count, [&](size_t begin, size_t end) {
+      T range_max = 0;
+      for (size_t i = begin; i < end; i++) {
+        Node* node = get_node_ptr<S, Node>(nodes, _s, (S)i);
+        T d = dot(node->v, node->v, f);
+        T norm = d < 0 ? 0 : sqrt(d);
+        node->dot_factor = norm;
+        if (norm > range_max) {
+          range_max = norm;
+        }
+      }
+      T seen = max_norm.load();
+      while (range_max > seen && !max_norm.compare_exchange_weak(seen, range_max)) {}
+    });
+
+    // Step two: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
+    const T max = max_norm.load();
+    threaded_build_policy.parallel_for((size_t)node_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        Node* node = get_node_ptr<S, Node>(nodes, _s, (S)i);
+        T node_norm = node->dot_factor;
+        T squared_norm_diff = pow(max, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0));
+        T dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
+
+        node->dot_factor = dot_factor;
+      }
+    });
+  }
+};
+
+struct Hamming : Base {
+  template<typename S, typename T>
+  struct Node {
+    S n_descendants;
+    S children[2];
+    T v[ANNOYLIB_V_ARRAY_SIZE];
+  };
+
+  static const size_t max_iterations = 20;
+
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    return distance - (margin != (unsigned int) child_nr);
+  }
+
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::max();
+  }
+  template<typename T>
+  static inline int cole_popcount(T v) {
+    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
+    // calculate std::bitset::count for v > 32bit. Uses the generalized
+    // approach by Eric Cole.
+    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
+    v = v - ((v >> 1) & (T)~(T)0/3);
+    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
+    v = (v + (v >> 4)) & (T)~(T)0/255*15;
+    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
+  }
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    size_t dist = 0;
+    for (int i = 0; i < f; i++) {
+      dist += annoylib_popcount(x->v[i] ^ y->v[i]);
+    }
+    return dist;
+  }
+  template<typename S, typename T>
+  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
+    static const size_t n_bits = sizeof(T) * 8;
+    T chunk = n->v[0] / n_bits;
+    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    return margin(n, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    size_t cur_size = 0;
+    size_t i = 0;
+    int dim = f * 8 * sizeof(T);
+    for (; i < max_iterations; i++) {
+      // choose random position to split at
+      n->v[0] = random.index(dim);
+      cur_size = 0;
+      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        if (margin(n, (*it)->v, f)) {
+          cur_size++;
+        }
+      }
+      if (cur_size > 0 && cur_size < nodes.size()) {
+        break;
+      }
+    }
+    // brute-force search for splitting coordinate
+    if (i == max_iterations) {
+      int j = 0;
+      for (; j < dim; j++) {
+        n->v[0] = j;
+        cur_size = 0;
+        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+          if (margin(n, (*it)->v, f)) {
+            cur_size++;
+          }
+        }
+        if (cur_size > 0 && cur_size < nodes.size()) {
+          break;
+        }
+      }
+    }
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return distance;
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "hamming";
+  }
+};
+
+
+struct Minkowski : Base {
+  template<typename S, typename T>
+  struct Node {
+    S n_descendants;
+    T a; // need an extra constant term to determine the offset of the plane
+    S children[2];
+    T v[ANNOYLIB_V_ARRAY_SIZE];
+  };
+  template<typename S, typename T>
+  static inline T margin(const Node<S, T>* n, const T* y, int f) {
+    return n->a + dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
+  }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+};
+
+
+struct Euclidean : Minkowski {
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return euclidean_distance(x->v, y->v, f);    
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "euclidean";
+  }
+
+};
+
+struct Manhattan : Minkowski {
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return manhattan_distance(x->v, y->v, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return std::max(distance, T(0));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "manhattan";
+  }
+};
+
+// The distance between x and y for a query that only needs it if it is at
+// most bound. Metrics summing a term per dimension stop early once past it,
+// returning something between bound and the distance; the others compute
+// it in full.
+template<typename D>
+struct BoundedDistance {
+  template<typename Node, typename T>
+  static inline T distance(const Node* x, const Node* y, int f, T bound) {
+    return D::distance(x, y, f);
+  }
+};
+
+template<>
+struct BoundedDistance<Euclidean> {
+  template<typename Node, typename T>
+  static inline T distance(const Node* x, const Node* y, int f, T bound) {
+    return euclidean_distance_bounded(x->v, y->v, f, bound);
+  }
+};
+
+template<>
+struct BoundedDistance<Manhattan> {
+  template<typename Node, typename T>
+  static inline T distance(const Node* x, const Node* y, int f, T bound) {
+    return manhattan_distance_bounded(x->v, y->v, f, bound);
+  }
+};
+
+// Encodes v as offset + scale * codes, with codes in [-127, 127]. Returns the
+// squared norm of the decoded vector.
+template<typename T>
+inline T quantize_int8(const T* v, int f, int8_t* codes, T* scale, T* offset) {
+  T lo = f > 0 ? v[0] : 0, hi = lo;
+  for (int z = 1; z < f; z++) {
+    lo = std::min(lo, v[z]);
+    hi = std::max(hi, v[z]);
+  }
+  *offset = (hi + lo) / 2;
+  *scale = (hi - lo) / 254;
+
+  T norm = 0;
+  for (int z = 0; z < f; z++) {
+    long c = *scale > 0 ? lrint((v[z] - *offset) / *scale) : 0;
+    codes[z] = (int8_t)std::max(-127L, std::min(127L, c));
+    T x = *offset + *scale * codes[z];
+    norm += x * x;
+  }
+  return norm;
+}
+
+// How a quantized index stores its vectors, recorded in its header.
+enum AnnoyElementType {
+  ANNOYLIB_ELEMENT_INT8 = 1,
+  ANNOYLIB_ELEMENT_FLOAT16 = 2,
+  ANNOYLIB_ELEMENT_BFLOAT16 = 3,
+  ANNOYLIB_ELEMENT_FLOAT32 = 4
+};
+
+// Encodes and scores vectors stored as codes C. A vector stands for
+// offset + scale * decode(codes); only int8 codes need the scale and offset.
+// float codes keep the vectors as they are, for the split layout alone.
+template<typename C>
+struct AnnoyCodec;
+
+template<>
+struct AnnoyCodec<int8_t> {
+  static const AnnoyElementType element = ANNOYLIB_ELEMENT_INT8;
+  static float encode(const float* v, int f, int8_t* codes, float* scale, float* offset) {
+    return quantize_int8(v, f, codes, scale, offset);
+  }
+  static float decode(int8_t c) {
+    return c;
+  }
+  static float dot(const float* x, const int8_t* c, int f) {
+    return dot_i8(x, c, f);
+  }
+  static float manhattan_distance(const float* x, const int8_t* c, float offset, float scale, int f) {
+    return manhattan_distance_i8(x, c, offset, scale, f);
+  }
+  static float euclidean_distance(const float* x, const int8_t* c, float offset, float scale, int f) {
+    return euclidean_distance_i8(x, c, offset, scale, f);
+  }
+};
+
+template<>
+struct AnnoyCodec<annoy_float16> {
+  static const AnnoyElementType element = ANNOYLIB_ELEMENT_FLOAT16;
+  static float encode(const float* v, int f, annoy_float16* codes, float* scale, float* offset) {
+    float norm = 0;
+    for (int z = 0; z < f; z++) {
+      codes[z].bits = float_to_float16(v[z]);
+      float x = float16_to_float(codes[z].bits);
+      norm += x * x;
+    }
+    *scale = 1;
+    *offset = 0;
+    return norm;
+  }
+  static float decode(annoy_float16 c) {
+    return float16_to_float(c.bits);
+  }
+  static float dot(const float* x, const annoy_float16* c, int f) {
+    return dot_f16(x, c, f);
+  }
+  static float manhattan_distance(const float* x, const annoy_float16* c, float offset, float scale, int f) {
+    return manhattan_distance_f16(x, c, f);
+  }
+  static float euclidean_distance(const float* x, const annoy_float16* c, float offset, float scale, int f) {
+    return euclidean_distance_f16(x, c, f);
+  }
+};
+
+template<>
+struct AnnoyCodec<annoy_bfloat16> {
+  static const AnnoyElementType element = ANNOYLIB_ELEMENT_BFLOAT16;
+  static float encode(const float* v, int f, annoy_bfloat16* codes, float* scale, float* offset) {
+    float norm = 0;
+    for (int z = 0; z < f; z++) {
+      codes[z].bits = float_to_bfloat16(v[z]);
+      float x = bfloat16_to_float(codes[z].bits);
+      norm += x * x;
+    }
+    *scale = 1;
+    *offset = 0;
+    return norm;
+  }
+  static float decode(annoy_bfloat16 c) {
+    return bfloat16_to_float(c.bits);
+  }
+  static float dot(const float* x, const annoy_bfloat16* c, int f) {
+    return dot_bf16(x, c, f);
+  }
+  static float manhattan_distance(const float* x, const annoy_bfloat16* c, float offset, float scale, int f) {
+    return manhattan_distance_bf16(x, c, f);
+  }
+  static float euclidean_distance(const float* x, const annoy_bfloat16* c, float offset, float scale, int f) {
+    return euclidean_distance_bf16(x, c, f);
+  }
+};
+
+template<>
+struct AnnoyCodec<float> {
+  static const AnnoyElementType element = ANNOYLIB_ELEMENT_FLOAT32;
+  static float encode(const float* v, int f, float* codes, float* scale, float* offset) {
+    memcpy(codes, v, f * sizeof(float));
+    *scale = 1;
+    *offset = 0;
+    return Annoy::dot(v, v, f);
+  }
+  static float decode(float c) {
+    return c;
+  }
+  static float dot(const float* x, const float* c, int f) {
+    return Annoy::dot(x, c, f);
+  }
+  static float manhattan_distance(const float* x, const float* c, float offset, float scale, int f) {
+    return Annoy::manhattan_distance(x, c, f);
+  }
+  static float euclidean_distance(const float* x, const float* c, float offset, float scale, int f) {
+    return Annoy::euclidean_distance(x, c, f);
+  }
+};
+
+#define ANNOYLIB_QUANTIZED_MAGIC "ANNOYQ8"
+
+struct AnnoyQuantizedHeader {
+  /*
+   * Start of a file written by AnnoyIndex::save_quantized, followed by the
+   * roots, the pool of leaf list children, the items, the nodes and the
+   * split planes.
+   */
+  char magic[8];
+  int32_t version;
+  int32_t f;
+  int32_t K; // nodes with at most this many descendants are leaf lists
+  int32_t n_items;
+  int32_t n_nodes; // split planes and leaf lists, numbered from n_items on
+  int32_t n_planes;
+  int32_t n_roots;
+  int32_t n_children;
+  char metric[16];
+  int32_t element; // an AnnoyElementType
+  int32_t subvectors; // if not 0, items are product quantized, see save_pq
+};
+
+template<typename C>
+struct AnnoyQuantizedItem {
+  float scale; // the vector is offset + scale * codes
+  float offset;
+  float norm; // squared norm of the vector, negative for items never added
+  C codes[ANNOYLIB_V_ARRAY_SIZE];
+};
+
+struct AnnoyQuantizedNode {
+  /*
+   * A split, or a leaf list of n_descendants items starting at children[0]
+   * in the pool. Only splits have a plane, so leaf lists take no room for
+   * one.
+   */
+  int32_t n_descendants;
+  int32_t children[2];
+  int32_t plane;
+};
+
+template<typename C>
+struct AnnoyQuantizedPlane {
+  float bias; // the plane's constant term
+  float scale; // the normal is offset + scale * codes
+  float offset;
+  C codes[ANNOYLIB_V_ARRAY_SIZE];
+};
+
+template<typename C>
+inline size_t quantized_size(size_t header, int f) {
+  return (header + sizeof(C) * f + 3) & ~(size_t)3;
+}
+
+// Reads the header of a file written by save_quantized or save_pq, to know
+// which AnnoyQuantizedIndex to load it with.
+inline bool read_quantized_header(const char* filename, AnnoyQuantizedHeader* header, char** error=NULL) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    set_error_from_errno(error, "Unable to open");
+    return false;
+  }
+  bool ok = fread(header, sizeof(*header), 1, f) == 1;
+  fclose(f);
+  if (!ok || memcmp(header->magic, ANNOYLIB_QUANTIZED_MAGIC, sizeof(header->magic))) {
+    set_error_from_string(error, "Not a quantized index");
+    return false;
+  }
+  return true;
+}
+
+// Product quantization: a vector is split into subvectors, each stored as
+// the byte numbering the closest of the centroids trained for it.
+#define ANNOYLIB_PQ_CENTROIDS 256
+// vectors sampled to train the centroids on, and k-means rounds.
+#define ANNOYLIB_PQ_SAMPLE 16384
+#define ANNOYLIB_PQ_ITERATIONS 10
+
+// How product quantized items are scored: the distance between a query and
+// an item is summed from a table, per subvector, of the query's partial
+// distance to each centroid.
+template<typename D>
+struct PQDistance;
+
+template<>
+struct PQDistance<Angular> {
+  static const bool normalize = true; // only the directions matter
+  static float partial(const float* q, const float* c, int d) {
+    return dot(q, c, d);
+  }
+  static float distance(float sum, float q_norm, float x_norm) {
+    float ppqq = q_norm * x_norm;
+    if (ppqq > 0) return 2.0 - 2.0 * sum / sqrt(ppqq);
+    else return 2.0;
+  }
+};
+
+template<>
+struct PQDistance<DotProduct> {
+  static const bool normalize = false;
+  static float partial(const float* q, const float* c, int d) {
+    return dot(q, c, d);
+  }
+  static float distance(float sum, float q_norm, float x_norm) {
+    return -sum;
+  }
+};
+
+template<>
+struct PQDistance<Euclidean> {
+  static const bool normalize = false;
+  static float partial(const float* q, const float* c, int d) {
+    return euclidean_distance(q, c, d);
+  }
+  static float distance(float sum, float q_norm, float x_norm) {
+    return sum;
+  }
+};
+
+template<>
+struct PQDistance<Manhattan> {
+  static const bool normalize = false;
+  static float partial(const float* q, const float* c, int d) {
+    return manhattan_distance(q, c, d);
+  }
+  static float distance(float sum, float q_norm, float x_norm) {
+    return sum;
+  }
+};
+
+inline int nearest_centroid(const float* x, const float* centroids, int d) {
+  int best = 0;
+  float best_distance = numeric_limits<float>::max();
+  for (int c = 0; c < ANNOYLIB_PQ_CENTROIDS; c++) {
+    float distance = euclidean_distance(x, centroids + (size_t)c * d, d);
+    if (distance < best_distance) {
+      best_distance = distance;
+      best = c;
+    }
+  }
+  return best;
+}
+
+// Trains the centroids of each subvector by k-means on n sample vectors,
+// into codebook: subvectors * ANNOYLIB_PQ_CENTROIDS centroids of f /
+// subvectors floats. Empty clusters are moved to a random sample.
+template<typename Random>
+inline void train_pq(const float* sample, size_t n, int f, int subvectors, Random& random, float* codebook) {
+  const int k = ANNOYLIB_PQ_CENTROIDS, d = f / subvectors;
+  vector<float> sums((size_t)k * d);
+  vector<size_t> counts(k);
+  for (int j = 0; j < subvectors; j++) {
+    float* centroids = codebook + (size_t)j * k * d;
+    for (int c = 0; c < k; c++)
+      memcpy(centroids + (size_t)c * d, sample + random.index(n) * f + j * d, d * sizeof(float));
+
+    for (int iteration = 0; iteration < ANNOYLIB_PQ_ITERATIONS; iteration++) {
+      std::fill(sums.begin(), sums.end(), 0);
+      std::fill(counts.begin(), counts.end(), 0);
+      for (size_t i = 0; i < n; i++) {
+        const float* x = sample + i * f + j * d;
+        int c = nearest_centroid(x, centroids, d);
+        counts[c]++;
+        for (int z = 0; z < d; z++)
+          sums[(size_t)c * d + z] += x[z];
+      }
+      for (int c = 0; c < k; c++) {
+        if (counts[c] == 0) {
+          memcpy(centroids + (size_t)c * d, sample + random.index(n) * f + j * d, d * sizeof(float));
+          continue;
+        }
+        for (int z = 0; z < d; z++)
+          centroids[(size_t)c * d + z] = sums[(size_t)c * d + z] / counts[c];
+      }
+    }
+  }
+}
+
+// bytes taken by the codes of n_items items, padded to keep what follows
+// aligned.
+inline size_t pq_items_size(size_t n_items, int subvectors) {
+  return (n_items * subvectors + 3) & ~(size_t)3;
+}
+
+inline void encode_pq(const float* v, int f, int subvectors, const float* codebook, uint8_t* codes) {
+  const int d = f / subvectors;
+  for (int j = 0; j < subvectors; j++)
+    codes[j] = (uint8_t)nearest_centroid(v + j * d, codebook + (size_t)j * ANNOYLIB_PQ_CENTROIDS * d, d);
+}
+
+template<typename S, typename T>
+struct AnnoyQueryState {
+  /*
+   * Everything a nearest neighbour query needs between two calls to
+   * AnnoyIndexInterface::query_advance, so that a long query can be run
+   * a bit at a time. A query first walks the trees collecting candidates
+   * (TRAVERSE), then computes their distances (SCORE).
+   */
+  enum Phase { TRAVERSE, SCORE, DONE };
+
+  AnnoyQueryState() : filter(NULL), filter_size(0), filter_deny(false) {}
+
+  Phase phase;
+  size_t n;
+  size_t search_k;
+  vector<char> query; // the query vector as a node of the index
+  vector<pair<T, S> > q; // priority queue of nodes to visit, kept as a heap
+  vector<S> nns; // candidates, each once, in the order they were found
+  vector<uint64_t> seen; // bitset over item ids of the candidates in nns
+  size_t found; // candidates found so far, counting those in several trees
+  size_t scored; // candidates scored so far
+  size_t keep; // scored candidates to keep
+  vector<pair<T, S> > nns_dist; // the closest keep of them, kept as a max-heap
+  vector<T> table; // per query lookup table, for product quantized indexes
+  std::chrono::steady_clock::time_point started;
+
+  // Optional filter on candidates, set before beginning the query: a bitset
+  // over item ids, most significant bit of each byte first. Only ids whose
+  // bit is set are candidates, or only those whose bit is clear if
+  // filter_deny. Ids past the end of the bitset count as clear. Filtered
+  // ids are dropped as leaves are reached, so they never get scored and
+  // don't count towards search_k. The bitset is owned by the caller.
+  const unsigned char* filter;
+  size_t filter_size; // in bytes
+  bool filter_deny;
+
+  bool passes(S i) const {
+    if (!filter)
+      return true;
+    size_t byte = (size_t)i >> 3;
+    bool set = byte < filter_size && (filter[byte] & (0x80 >> (i & 7)));
+    return set != filter_deny;
+  }
+
+  // Readies a state for another query. Its buffers keep their capacity,
+  // so reusing one state makes no heap allocations once they have grown to
+  // fit, unless a query needed more than max_capacity entries: that memory
+  // is given back. seen is kept whatever its size, as it is sized by the
+  // index rather than by the query.
+  void reuse(size_t max_capacity) {
+    filter = NULL;
+    filter_size = 0;
+    filter_deny = false;
+    _trim(q, max_capacity);
+    _trim(nns_dist, max_capacity);
+    if (nns.capacity() > max_capacity) {
+      // seen is cleared through nns, so that goes first.
+      _clear_seen();
+      vector<S>().swap(nns);
+    }
+  }
+
+  // Forgets the candidates of the last query, for one over n_items items.
+  // Only the bits of those candidates are cleared, so this takes time in
+  // the size of the last query rather than of the index.
+  void begin_candidates(size_t n_items) {
+    _clear_seen();
+    nns.clear();
+    seen.resize((n_items + 63) >> 6);
+    found = 0;
+  }
+
+  // The distance a scored candidate has to beat to be kept.
+  T bound() const {
+    if (nns_dist.size() < keep || nns_dist.empty())
+      return numeric_limits<T>::max();
+    return nns_dist.front().first;
+  }
+
+  // Keeps candidate i at distance d if it is among the closest keep so far.
+  void offer(T d, S i) {
+    pair<T, S> p(d, i);
+    if (nns_dist.size() < keep) {
+      nns_dist.push_back(p);
+      std::push_heap(nns_dist.begin(), nns_dist.end());
+    } else if (keep > 0 && p < nns_dist.front()) {
+      std::pop_heap(nns_dist.begin(), nns_dist.end());
+      nns_dist.back() = p;
+      std::push_heap(nns_dist.begin(), nns_dist.end());
+    }
+  }
+
+  // Adds item i to the candidates, unless it is one already. Returns false
+  // for such a duplicate.
+  bool add_candidate(S i) {
+    found++;
+    if (((size_t)i >> 6) >= seen.size())
+      seen.resize(((size_t)i >> 6) + 1);
+    uint64_t& word = seen[(size_t)i >> 6];
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (word & bit)
+      return false;
+    word |= bit;
+    nns.push_back(i);
+    return true;
+  }
+
+private:
+  void _clear_seen() {
+    for (size_t i = 0; i < nns.size(); i++) {
+      size_t word = (size_t)nns[i] >> 6;
+      if (word < seen.size())
+        seen[word] = 0;
+    }
+  }
+
+  template<typename V>
+  static void _trim(V& v, size_t max_capacity) {
+    if (v.capacity() > max_capacity)
+      V().swap(v);
+  }
+};
+
+// Queries query_advance_all keeps in flight at once.
+#ifndef ANNOYLIB_INTERLEAVE
+#define ANNOYLIB_INTERLEAVE 8
+#endif
+
+// Entries a reused query buffer may keep between queries.
+#ifndef ANNOYLIB_QUERY_BUFFER_CAPACITY
+#define ANNOYLIB_QUERY_BUFFER_CAPACITY (1 << 18)
+#endif
+
+template<typename S, typename T>
+struct AnnoyQueryContext {
+  /*
+   * A query state and buffers for its results and query vector, reused
+   * from query to query so that a steady stream of them allocates nothing.
+   * Callers that run queries on threads of their own take the context of
+   * the thread with local() and begin each query with reuse().
+   */
+  AnnoyQueryState<S, T> state;
+  vector<S> result;
+  vector<T> distances;
+  vector<T> query_vector; // for callers that need to convert the query first
+
+  vector<AnnoyQueryState<S, T> > batch; // for query_advance_all
+  vector<AnnoyQueryState<S, T>*> batch_states;
+
+  // for get_nns_by_item and get_nns_by_vector, which callers may run while
+  // they hold state.
+  AnnoyQueryState<S, T> whole;
+
+  AnnoyQueryState<S, T>* reuse() {
+    state.reuse(ANNOYLIB_QUERY_BUFFER_CAPACITY);
+    result.clear();
+    distances.clear();
+    return &state;
+  }
+
+  AnnoyQueryState<S, T>* reuse_whole() {
+    whole.reuse(ANNOYLIB_QUERY_BUFFER_CAPACITY);
+    return &whole;
+  }
+
+  // count states to run together, for query_advance_all.
+  AnnoyQueryState<S, T>** reuse_batch(size_t count) {
+    if (batch.size() < count) {
+      batch.resize(count);
+      batch_states.resize(count);
+    }
+    for (size_t i = 0; i < count; i++) {
+      batch[i].reuse(ANNOYLIB_QUERY_BUFFER_CAPACITY);
+      batch_states[i] = &batch[i];
+    }
+    return batch_states.data();
+  }
+
+  static AnnoyQueryContext& local() {
+    static thread_local AnnoyQueryContext context;
+    return context;
+  }
+};
+
+struct AnnoyIndexStats {
+  /*
+   * Counters an index keeps as it is used. They are only ever updated with
+   * relaxed atomics, so reading them while queries run is cheap and gives
+   * a snapshot that is consistent enough for monitoring.
+   */
+  static const int LATENCY_BUCKETS = 32;
+
+  std::atomic<uint64_t> queries;
+  std::atomic<uint64_t> visited_nodes; // nodes popped off the priority queue
+  std::atomic<uint64_t> distance_evaluations;
+  std::atomic<uint64_t> duplicates; // candidates found in more than one tree, skipped
+  // queries by time taken: bucket 0 counts those under 1us, bucket i > 0
+  // those taking [2^(i-1), 2^i) us, the last one everything slower.
+  std::atomic<uint64_t> latency[LATENCY_BUCKETS];
+  std::atomic<uint64_t> reallocations; // of the node array, see _reallocate_nodes
+  // wall time of the phases of the last build, in microseconds.
+  std::atomic<uint64_t> preprocess_us;
+  std::atomic<uint64_t> thread_build_us;
+  std::atomic<uint64_t> roots_copy_us;
+
+  AnnoyIndexStats() {
+    queries = 0;
+    visited_nodes = 0;
+    distance_evaluations = 0;
+    duplicates = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+      latency[i] = 0;
+    reallocations = 0;
+    preprocess_us = 0;
+    thread_build_us = 0;
+    roots_copy_us = 0;
+  }
+
+  static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static void set(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(n, std::memory_order_relaxed);
+  }
+
+  static uint64_t get(const std::atomic<uint64_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+
+  static uint64_t elapsed_us(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+  }
+
+  void add_latency(uint64_t us) {
+    int bucket = 0;
+    while (us > 0 && bucket < LATENCY_BUCKETS - 1) {
+      us >>= 1;
+      bucket++;
+    }
+    add(latency[bucket], 1);
+  }
+};
+
+// The order tree nodes are stored in. save() writes them blocked, see
+// AnnoyIndex::_write_blocked, and says so with a marker node right after the
+// items: one with no descendants, so that nothing reaches it, then
+// ANNOYLIB_LAYOUT_MAGIC and the layout as an int32.
+enum AnnoyLayout {
+  ANNOYLIB_LAYOUT_BUILD = 0, // as the trees were built, interleaved
+  ANNOYLIB_LAYOUT_BLOCKED = 1 // tree by tree, in page sized subtrees
+};
+
+#define ANNOYLIB_LAYOUT_MAGIC "ANNOYLAY"
+
+// Bytes of nodes save() keeps together, a page.
+#ifndef ANNOYLIB_LAYOUT_BLOCK_BYTES
+#define ANNOYLIB_LAYOUT_BLOCK_BYTES 4096
+#endif
+
+template<typename S, typename T, typename R = uint64_t>
+class AnnoyIndexInterface {
+ public:
+  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
+  virtual ~AnnoyIndexInterface() {};
+  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool add_items(const S* items, S first, const T* w, size_t n, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool unbuild(char** error=NULL) = 0;
+  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual void unload() = 0;
+  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual T get_distance(S i, S j) const = 0;
+  virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual S get_n_items() const = 0;
+  virtual S get_n_trees() const = 0;
+  virtual void verbose(bool v) = 0;
+  virtual void get_item(S item, T* v) const = 0;
+  virtual void set_seed(R q) = 0;
+  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
+  // Writes a read-only copy of the built index with vectors stored as element,
+  // see AnnoyQuantizedIndex, and the float vectors to vectors_filename if given.
+  virtual bool save_quantized(const char* filename, AnnoyElementType element,
+                              const char* vectors_filename=NULL, char** error=NULL) = 0;
+  // Same with the items product quantized to subvectors bytes each, and the
+  // split planes stored as float16.
+  virtual bool save_pq(const char* filename, int subvectors,
+                       const char* vectors_filename=NULL, char** error=NULL) = 0;
+  // Resumable queries: begin, then advance until it returns true, then finish.
+  // query_begin_by_item expects an item of the index, 0 <= item < get_n_items().
+  virtual void query_begin_by_item(AnnoyQueryState<S, T>* state, S item, size_t n, int search_k) const = 0;
+  virtual void query_begin_by_vector(AnnoyQueryState<S, T>* state, const T* w, size_t n, int search_k) const = 0;
+  virtual bool query_advance(AnnoyQueryState<S, T>* state, size_t max_steps) const = 0;
+  virtual void query_finish(AnnoyQueryState<S, T>* state, vector<S>* result, vector<T>* distances) const = 0;
+  // Advances count begun queries until all of them are done, interleaving
+  // their steps so that the nodes one needs next are fetched from memory
+  // while the others run.
+  virtual void query_advance_all(AnnoyQueryState<S, T>* const* states, size_t count) const = 0;
+  // The sides a query for w takes down the first tree, one bit per split
+  // from the top bit down. Queries with close paths visit much the same
+  // nodes and items, so running them together reuses what is in cache.
+  virtual uint64_t get_query_path(const T* w) const = 0;
+  virtual const AnnoyIndexStats& get_stats() const = 0;
+  virtual AnnoyLayout get_layout() const = 0;
+  // Changes whenever items or trees do. A query begun under one generation
+  // can't be advanced under another: its nodes and candidates are stale.
+  virtual uint64_t get_generation() const = 0;
+};
+
+// Subtrees of at least this many items are built as tasks of their own,
+// which other build threads can take.
+#ifndef ANNOYLIB_BUILD_TASK_ITEMS
+#define ANNOYLIB_BUILD_TASK_ITEMS 2048
+#endif
+
+// Nodes a build thread takes for itself at a time, see AnnoyIndex::NodeArena.
+#ifndef ANNOYLIB_ARENA_NODES
+#define ANNOYLIB_ARENA_NODES 1024
+#endif
+
+template<typename S, typename T, typename Distance, typename Random, class ThreadedBuildPolicy>
+  class AnnoyIndex : public AnnoyIndexInterface<S, T, 
+#if __cplusplus >= 201103L
+    typename std::remove_const<decltype(Random::default_seed)>::type
+#else
+    typename Random::seed_type
+#endif
+    > {
+  /*
+   * We use random projection to build a forest of binary trees of all items.
+   * Basically just split the hyperspace into two sides by a hyperplane,
+   * then recursively split each of those subtrees etc.
+   * We create a tree like this q times. The default q is determined automatically
+   * in such a way that we at most use 2x as much memory as the vectors take.
+   */
+public:
+  typedef Distance D;
+  typedef typename D::template Node<S, T> Node;
+#if __cplusplus >= 201103L
+  typedef typename std::remove_const<decltype(Random::default_seed)>::type R;
+#else
+  typedef typename Random::seed_type R;
+#endif
+
+protected:
+  const int _f;
+  size_t _s;
+  S _n_items;
+  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
+  S _n_nodes;
+  S _nodes_size;
+  vector<S> _roots;
+  S _K;
+  R _seed;
+  bool _loaded;
+  bool _verbose;
+  int _fd;
+  bool _on_disk;
+  bool _built;
+  AnnoyLayout _layout;
+  mutable AnnoyIndexStats _stats;
+  uint64_t _generation; // see get_generation
+
+  struct NodeArena {
     /*
-     * We store a binary tree where each node has two things
-     * - A vector associated with it
-     * - Two children
-     * All nodes occupy the same amount of memory
-     * All nodes with n_descendants == 1 are leaf nodes.
-     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
-     * we skip the vector. Instead we store a list of all descendants. K is
-     * determined by the number of items that fits in the space of the vector.
-     * For nodes with n_descendants == 1 the vector is a data point.
-     * For nodes with n_descendants > K the vector is the normal of the split plane.
-     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
-     * more memory to be able to fit the vector outside
+     * The nodes a build thread makes, in chunks of ANNOYLIB_ARENA_NODES
+     * nodes numbered from a shared counter, so that making a node takes
+     * no lock: node k of chunk c is numbered _n_nodes + c * chunk size + k
+     * until _compact_trees moves it into _nodes.
+     *
+     * In memory the chunks are kept until then, so the build peaks at the
+     * items plus twice the trees. Building on disk, a thread only keeps the
+     * chunk it is filling, and writes each one to the file where its
+     * numbers say; _compact_trees then renumbers the nodes in place. That
+     * peaks at a chunk per thread and 4 bytes per node in memory, and the
+     * file holds at most a chunk per thread more than the index.
      */
-    S n_descendants;
-    union {
-      S children[2]; // Will possibly store more than 2
-      T norm;
-    };
-    T v[ANNOYLIB_V_ARRAY_SIZE];
+    vector<S> numbers;
+    vector<vector<char> > chunks;
+    S used; // nodes used in the last chunk
+
+    NodeArena() : used(0) {}
   };
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    // want to calculate (a/|a| - b/|b|)^2
-    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
-    // = 2 - 2cos
-    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
-    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
-    T pq = dot(x->v, y->v, f);
-    T ppqq = pp * qq;
-    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
-    else return 2.0; // cos is 0
+  vector<NodeArena> _arenas; // one per build thread
+  std::atomic<S> _n_chunks;
+  std::atomic<int> _arena_errno; // of a failed write of a chunk to disk, or 0
+
+public:
+
+   AnnoyIndex(int f) : _f(f), _seed(Random::default_seed), _generation(0), _n_chunks(0), _arena_errno(0) {
+    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
+    _verbose = false;
+    _built = false;
+    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
+    reinitialize(); // Reset everything
+  }
+  ~AnnoyIndex() {
+    unload();
+  }
+
+  int get_f() const {
+    return _f;
+  }
+
+  bool add_item(S item, const T* w, char** error=NULL) {
+    return add_item_impl(item, w, error);
+  }
+
+  template<typename W>
+  bool add_item_impl(S item, const W& w, char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    _allocate_size(item + 1);
+    _generation++;
+    Node* n = _get(item);
+
+    D::zero_value(n);
+
+    n->children[0] = 0;
+    n->children[1] = 0;
+    n->n_descendants = 1;
+
+    for (int z = 0; z < _f; z++)
+      n->v[z] = w[z];
+
+    D::init_node(n, _f);
+
+    if (item >= _n_items)
+      _n_items = item + 1;
+
+    return true;
+  }
+
+  bool add_items(const S* items, S first, const T* w, size_t n, int n_threads=-1, char** error=NULL) {
+    // Adds n row-major vectors from w, either as items[0..n) or, if items is
+    // NULL, as the consecutive items first..first+n-1.  Item ids should be unique.
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    if (n == 0)
+      return true;
+
+    S last = items ? *std::max_element(items, items + n) : first + (S)(n - 1);
+    _allocate_size(last + 1);
+    _generation++;
+
+    ThreadedBuildPolicy::parallel_for(n, n_threads, [&](size_t begin, size_t end) {
+      for (size_t k = begin; k < end; k++) {
+        Node* node = _get(items ? items[k] : first + (S)k);
+
+        D::zero_value(node);
+
+        node->children[0] = 0;
+        node->children[1] = 0;
+        node->n_descendants = 1;
+
+        memcpy(node->v, w + k * _f, _f * sizeof(T));
+
+        D::init_node(node, _f);
+      }
+    });
+
+    if (last >= _n_items)
+      _n_items = last + 1;
+
+    return true;
+  }
+    
+  bool on_disk_build(const char* file, char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't build a loaded index on disk");
+      return false;
+    }
+    _on_disk = true;
+    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    _nodes_size = 1;
+    if (ftruncate(_fd, ANNOYLIB_FTRUNCATE_SIZE(_s) * ANNOYLIB_FTRUNCATE_SIZE(_nodes_size)) == -1) {
+      set_error_from_errno(error, "Unable to truncate");
+      return false;
+    }
+#ifdef MAP_POPULATE
+    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
+#else
+    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#endif
+    return true;
+  }
+    
+  bool build(int q, int n_threads=-1, char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't build a loaded index");
+      return false;
+    }
+
+    if (_built) {
+      set_error_from_string(error, "You can't build a built index");
+      return false;
+    }
+
+    // Preprocessing and the trees share the build threads.
+    std::chrono::steady_clock::time_point phase_start;
+    ThreadedBuildPolicy::run(n_threads, [&](ThreadedBuildPolicy& threaded_build_policy) {
+      phase_start = std::chrono::steady_clock::now();
+      D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f, threaded_build_policy);
+      AnnoyIndexStats::set(_stats.preprocess_us, AnnoyIndexStats::elapsed_us(phase_start));
+
+      _n_nodes = _n_items;
+
+      phase_start = std::chrono::steady_clock::now();
+      threaded_build_policy.build(this, q);
+    });
+    if (!_compact_trees(error))
+      return false;
+    AnnoyIndexStats::set(_stats.thread_build_us, AnnoyIndexStats::elapsed_us(phase_start));
+
+    // Also, copy the roots into the last segment of the array
+    // This way we can load them faster without reading the whole file
+    phase_start = std::chrono::steady_clock::now();
+    _allocate_size(_n_nodes + (S)_roots.size());
+    for (size_t i = 0; i < _roots.size(); i++)
+      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
+    _n_nodes += _roots.size();
+    AnnoyIndexStats::set(_stats.roots_copy_us, AnnoyIndexStats::elapsed_us(phase_start));
+
+    if (_verbose) annoylib_showUpdate("has %d nodes\n", _n_nodes);
+    
+    if (_on_disk) {
+      if (!remap_memory_and_truncate(&_nodes, _fd,
+          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
+          static_cast<size_t>(_s) * static_cast<size_t>(_n_nodes))) {
+        // TODO: this probably creates an index in a corrupt state... not sure what to do
+        set_error_from_errno(error, "Unable to truncate");
+        return false;
+      }
+      _nodes_size = _n_nodes;
+    }
+    _built = true;
+    _generation++;
+    return true;
+  }
+  
+  bool unbuild(char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't unbuild a loaded index");
+      return false;
+    }
+
+    _roots.clear();
+    _n_nodes = _n_items;
+    _built = false;
+    _generation++;
+
+    return true;
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    if (_on_disk) {
+      return true;
+    } else {
+      // Delete file if it already exists (See issue #335)
+      unlink(filename);
+
+      FILE *f = fopen(filename, "wb");
+      if (f == NULL) {
+        set_error_from_errno(error, "Unable to open");
+        return false;
+      }
+
+      if (!_write_blocked(f)) {
+        set_error_from_errno(error, "Unable to write");
+        fclose(f);
+        return false;
+      }
+
+      if (fclose(f) == EOF) {
+        set_error_from_errno(error, "Unable to close");
+        return false;
+      }
+
+      // A loaded index is left mapped as it is: it may be shared with other
+      // readers, and it holds the same trees as the file just written.
+      if (_loaded)
+        return true;
+
+      unload();
+      return load(filename, prefault, error);
+    }
+  }
+
+  bool save_quantized(const char* filename, AnnoyElementType element,
+                      const char* vectors_filename=NULL, char** error=NULL) {
+    switch (element) {
+    case ANNOYLIB_ELEMENT_INT8:
+      return _save_quantized<int8_t>(filename, vectors_filename, 0, error);
+    case ANNOYLIB_ELEMENT_FLOAT16:
+      return _save_quantized<annoy_float16>(filename, vectors_filename, 0, error);
+    case ANNOYLIB_ELEMENT_BFLOAT16:
+      return _save_quantized<annoy_bfloat16>(filename, vectors_filename, 0, error);
+    case ANNOYLIB_ELEMENT_FLOAT32:
+      return _save_quantized<float>(filename, vectors_filename, 0, error);
+    }
+    set_error_from_string(error, "Unknown element type");
+    return false;
+  }
+
+  bool save_pq(const char* filename, int subvectors, const char* vectors_filename=NULL, char** error=NULL) {
+    if (subvectors < 1 || subvectors > _f || _f % subvectors != 0) {
+      set_error_from_string(error, "The number of subvectors must divide the number of dimensions");
+      return false;
+    }
+    return _save_quantized<annoy_float16>(filename, vectors_filename, subvectors, error);
+  }
+
+  template<typename C>
+  bool _save_quantized(const char* filename, const char* vectors_filename, int subvectors, char** error) {
+    return _save_quantized<C>(filename, vectors_filename, subvectors, error, std::is_same<T, float>());
+  }
+
+  // Quantization encodes float vectors; other indexes, e.g. Hamming, can't be.
+  template<typename C>
+  bool _save_quantized(const char* filename, const char* vectors_filename, int subvectors, char** error,
+                       std::false_type) {
+    set_error_from_string(error, "You can only quantize an index of float vectors");
+    return false;
+  }
+
+  template<typename C>
+  bool _save_quantized(const char* filename, const char* vectors_filename, int subvectors, char** error,
+                       std::true_type) {
+    if (!_built) {
+      set_error_from_string(error, "You can't quantize an index that hasn't been built");
+      return false;
+    }
+
+    // train the product quantizer on a sample of the items.
+    vector<T> codebook;
+    if (subvectors) {
+      vector<S> items;
+      for (S i = 0; i < _n_items; i++)
+        if (_get(i)->n_descendants != 0)
+          items.push_back(i);
+      if (items.empty()) {
+        set_error_from_string(error, "You can't product quantize an index without items");
+        return false;
+      }
+      Random random(_seed);
+      size_t n_sample = std::min(items.size(), (size_t)ANNOYLIB_PQ_SAMPLE);
+      vector<T> sample(n_sample * _f);
+      for (size_t i = 0; i < n_sample; i++) {
+        S item = items.size() > n_sample ? items[random.index(items.size())] : items[i];
+        _pq_input(_get(item)->v, &sample[i * _f]);
+      }
+      codebook.resize((size_t)ANNOYLIB_PQ_CENTROIDS * _f);
+      train_pq(&sample[0], n_sample, _f, subvectors, random, &codebook[0]);
+    }
+
+    // gather the leaf lists into one pool of ids.
+    S n_nodes = _n_nodes - _n_items, n_planes = 0;
+    vector<S> children;
+    vector<AnnoyQuantizedNode> nodes(n_nodes);
+    for (S i = _n_items; i < _n_nodes; i++) {
+      Node* nd = _get(i);
+      AnnoyQuantizedNode& node = nodes[i - _n_items];
+      node.n_descendants = nd->n_descendants;
+      if (nd->n_descendants <= _K) {
+        node.children[0] = (S)children.size();
+        node.children[1] = 0;
+        node.plane = -1;
+        children.insert(children.end(), nd->children, nd->children + nd->n_descendants);
+      } else {
+        node.children[0] = nd->children[0];
+        node.children[1] = nd->children[1];
+        node.plane = n_planes++;
+      }
+    }
+
+    AnnoyQuantizedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANNOYLIB_QUANTIZED_MAGIC, sizeof(header.magic));
+    header.version = 3;
+    header.f = _f;
+    header.K = _K;
+    header.n_items = _n_items;
+    header.n_nodes = n_nodes;
+    header.n_planes = n_planes;
+    header.n_roots = (int32_t)_roots.size();
+    header.n_children = (int32_t)children.size();
+    strncpy(header.metric, D::name(), sizeof(header.metric) - 1);
+    header.element = AnnoyCodec<C>::element;
+    header.subvectors = subvectors;
+
+    unlink(filename);
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(_roots.data(), sizeof(S), _roots.size(), f) == _roots.size() &&
+              fwrite(children.data(), sizeof(S), children.size(), f) == children.size();
+
+    size_t item_size = quantized_size<C>(offsetof(AnnoyQuantizedItem<C>, codes), _f);
+    size_t plane_size = quantized_size<C>(offsetof(AnnoyQuantizedPlane<C>, codes), _f);
+    vector<char> buffer(std::max(item_size, plane_size));
+    AnnoyQuantizedItem<C>* item = (AnnoyQuantizedItem<C>*)&buffer[0];
+    if (subvectors) {
+      // items never added are encoded like zeros; traversals never reach them.
+      vector<uint8_t> codes(subvectors);
+      vector<T> v(_f);
+      for (S i = 0; ok && i < _n_items; i++) {
+        _pq_input(_get(i)->v, &v[0]);
+        encode_pq(&v[0], _f, subvectors, &codebook[0], &codes[0]);
+        ok = fwrite(&codes[0], 1, subvectors, f) == (size_t)subvectors;
+      }
+      size_t padding = pq_items_size(_n_items, subvectors) - (size_t)_n_items * subvectors;
+      uint8_t zeros[4] = {0, 0, 0, 0};
+      if (ok && padding)
+        ok = fwrite(zeros, 1, padding, f) == padding;
+    } else {
+      for (S i = 0; ok && i < _n_items; i++) {
+        Node* nd = _get(i);
+        std::fill(buffer.begin(), buffer.end(), 0);
+        if (nd->n_descendants == 0)
+          item->norm = -1;
+        else
+          item->norm = AnnoyCodec<C>::encode(nd->v, _f, item->codes, &item->scale, &item->offset);
+        ok = fwrite(item, item_size, 1, f) == 1;
+      }
+    }
+
+    if (ok)
+      ok = fwrite(nodes.data(), sizeof(AnnoyQuantizedNode), nodes.size(), f) == nodes.size();
+
+    // a split plane's constant term is its margin at the origin.
+    vector<T> origin(_f, 0);
+    AnnoyQuantizedPlane<C>* plane = (AnnoyQuantizedPlane<C>*)&buffer[0];
+    for (S i = _n_items; ok && i < _n_nodes; i++) {
+      Node* nd = _get(i);
+      if (nd->n_descendants <= _K)
+        continue;
+      std::fill(buffer.begin(), buffer.end(), 0);
+      plane->bias = D::margin(nd, &origin[0], _f);
+      AnnoyCodec<C>::encode(nd->v, _f, plane->codes, &plane->scale, &plane->offset);
+      ok = fwrite(plane, plane_size, 1, f) == 1;
+    }
+
+    if (ok && subvectors)
+      ok = fwrite(&codebook[0], sizeof(T), codebook.size(), f) == codebook.size();
+
+    if (!ok) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
+      return false;
+    }
+
+    if (vectors_filename) {
+      unlink(vectors_filename);
+      f = fopen(vectors_filename, "wb");
+      if (f == NULL) {
+        set_error_from_errno(error, "Unable to open");
+        return false;
+      }
+      for (S i = 0; ok && i < _n_items; i++)
+        ok = fwrite(_get(i)->v, sizeof(T), _f, f) == (size_t)_f;
+      if (!ok) {
+        set_error_from_errno(error, "Unable to write");
+        fclose(f);
+        return false;
+      }
+      if (fclose(f) == EOF) {
+        set_error_from_errno(error, "Unable to close");
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  void reinitialize() {
+    _fd = 0;
+    _nodes = NULL;
+    _loaded = false;
+    _n_items = 0;
+    _n_nodes = 0;
+    _nodes_size = 0;
+    _on_disk = false;
+    _seed = Random::default_seed;
+    _layout = ANNOYLIB_LAYOUT_BUILD;
+    _roots.clear();
+    _generation++;
+  }
+
+  void unload() {
+    if (_on_disk && _fd) {
+      close(_fd);
+      munmap(_nodes, _s * _nodes_size);
+    } else {
+      if (_fd) {
+        // we have mmapped data
+        close(_fd);
+        munmap(_nodes, _n_nodes * _s);
+      } else if (_nodes) {
+        // We have heap allocated data
+        free(_nodes);
+      }
+    }
+    reinitialize();
+    if (_verbose) annoylib_showUpdate("unloaded\n");
+  }
+
+  bool load(const char* filename, bool prefault=false, char** error=NULL) {
+    _fd = open(filename, O_RDONLY, (int)0400);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    off_t size = lseek_getsize(_fd);
+    if (size == -1) {
+      set_error_from_errno(error, "Unable to get size");
+      return false;
+    } else if (size == 0) {
+      set_error_from_errno(error, "Size of file is zero");
+      return false;
+    } else if (size % _s) {
+      // Something is fishy with this index!
+      set_error_from_errno(error, "Index size is not a multiple of vector size. Ensure you are opening using the same metric you used to create the index.");
+      return false;
+    }
+
+    int flags = MAP_SHARED;
+    if (prefault) {
+#ifdef MAP_POPULATE
+      flags |= MAP_POPULATE;
+#else
+      annoylib_showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
+#endif
+    }
+    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
+    _n_nodes = (S)(size / _s);
+
+    // Find the roots by scanning the end of the file and taking the nodes with most descendants
+    _roots.clear();
+    S m = -1;
+    for (S i = _n_nodes - 1; i >= 0; i--) {
+      S k = _get(i)->n_descendants;
+      if (m == -1 || k == m) {
+        _roots.push_back(i);
+        m = k;
+      } else {
+        break;
+      }
+    }
+    // hacky fix: since the last root precedes the copy of all roots, delete it
+    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
+      _roots.pop_back();
+    _loaded = true;
+    _built = true;
+    _n_items = m;
+    _layout = _read_layout();
+    if (_verbose) annoylib_showUpdate("found %lu roots with degree %d\n", _roots.size(), m);
+    return true;
+  }
+
+  AnnoyLayout get_layout() const {
+    return _layout;
+  }
+
+  uint64_t get_generation() const {
+    return _generation;
+  }
+
+  T get_distance(S i, S j) const {
+    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  }
+
+  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    // TODO: handle OOB
+    const Node* m = _get(item);
+    _get_all_nns(m->v, n, search_k, result, distances);
+  }
+
+  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    _get_all_nns(w, n, search_k, result, distances);
+  }
+
+  void query_begin_by_item(AnnoyQueryState<S, T>* state, S item, size_t n, int search_k) const {
+    const Node* m = _get(item);
+    _query_begin(state, m->v, n, search_k);
+  }
+
+  void query_begin_by_vector(AnnoyQueryState<S, T>* state, const T* w, size_t n, int search_k) const {
+    _query_begin(state, w, n, search_k);
+  }
+
+  bool query_advance(AnnoyQueryState<S, T>* state, size_t max_steps) const {
+    return _query_advance(state, max_steps);
+  }
+
+  void query_finish(AnnoyQueryState<S, T>* state, vector<S>* result, vector<T>* distances) const {
+    _query_finish(state, result, distances);
+  }
+
+  void query_advance_all(AnnoyQueryState<S, T>* const* states, size_t count) const {
+    _query_advance_all(states, count);
+  }
+
+  uint64_t get_query_path(const T* w) const {
+    uint64_t path = 0;
+    if (_roots.empty())
+      return path;
+    S i = _roots[0];
+    for (int bit = 63; bit >= 0; bit--) {
+      Node* nd = _get(i);
+      if (nd->n_descendants <= _K)
+        break;
+      bool side = D::margin(nd, w, _f) > 0;
+      path |= (uint64_t)side << bit;
+      i = nd->children[side];
+    }
+    return path;
+  }
+
+  const AnnoyIndexStats& get_stats() const {
+    return _stats;
+  }
+
+  S get_n_items() const {
+    return _n_items;
+  }
+
+  S get_n_trees() const {
+    return (S)_roots.size();
+  }
+
+  void verbose(bool v) {
+    _verbose = v;
+  }
+
+  void get_item(S item, T* v) const {
+    // TODO: handle OOB
+    Node* m = _get(item);
+    memcpy(v, m->v, (_f) * sizeof(T));
+  }
+
+  void set_seed(R seed) {
+    _seed = seed;
+  }
+
+  // Builds q trees, or if q is -1 as many as it takes for there to be twice
+  // as many nodes as items, one after the other on the calling thread.
+  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
+    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
+    Random _random(_seed + thread_idx);
+    _arenas.resize(threaded_build_policy.n_slots());
+
+    vector<S> thread_roots;
+    while (1) {
+      if (q == -1) {
+        if (_n_nodes + _arena_nodes() >= 2 * _n_items) {
+          break;
+        }
+      } else {
+        if (thread_roots.size() >= (size_t)q) {
+          break;
+        }
+      }
+
+      if (_verbose) annoylib_showUpdate("pass %zd...\n", thread_roots.size());
+
+      vector<S> indices;
+      for (S i = 0; i < _n_items; i++) {
+        if (_get(i)->n_descendants >= 1) { // Issue #223
+          indices.push_back(i);
+        }
+      }
+
+      thread_roots.push_back(_make_tree(indices, true, _random, threaded_build_policy));
+    }
+
+    _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
+  }
+
+  // Builds q trees as tasks of threaded_build_policy, or if q is -1 one
+  // after the other until there are twice as many nodes as items. Tree t
+  // is seeded with _seed + t alone, and its large subtrees get generators
+  // of their own, so the trees don't depend on how many threads build them.
+  void build_trees(int q, ThreadedBuildPolicy& threaded_build_policy) {
+    _arenas.resize(threaded_build_policy.n_slots());
+    vector<S> indices;
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants >= 1) { // Issue #223
+        indices.push_back(i);
+      }
+    }
+
+    if (q == -1) {
+      while (_n_nodes + _arena_nodes() < 2 * _n_items) {
+        if (_verbose) annoylib_showUpdate("pass %zd...\n", _roots.size());
+        S root;
+        threaded_build_policy.for_each(1, [&](size_t) {
+          Random random(_seed + _roots.size());
+          root = _make_tree(indices, true, random, threaded_build_policy);
+        });
+        _roots.push_back(root);
+      }
+      return;
+    }
+
+    vector<S> roots(q);
+    threaded_build_policy.for_each((size_t)q, [&](size_t tree) {
+      if (_verbose) annoylib_showUpdate("pass %zd...\n", tree);
+      Random random(_seed + tree);
+      roots[tree] = _make_tree(indices, true, random, threaded_build_policy);
+    });
+    _roots.insert(_roots.end(), roots.begin(), roots.end());
   }
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f);
+
+protected:
+  // v as product quantization sees it.
+  void _pq_input(const T* v, T* out) const {
+    memcpy(out, v, _f * sizeof(T));
+    if (PQDistance<D>::normalize) {
+      T norm = get_norm(out, _f);
+      if (norm > 0)
+        for (int z = 0; z < _f; z++)
+          out[z] /= norm;
+    }
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+
+  // Whether the marker node fits: it needs 12 bytes after n_descendants.
+  bool _layout_marker_fits() const {
+    return _s >= sizeof(S) + sizeof(ANNOYLIB_LAYOUT_MAGIC) - 1 + sizeof(int32_t);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
+
+  AnnoyLayout _read_layout() const {
+    if (_n_nodes <= _n_items || !_layout_marker_fits())
+      return ANNOYLIB_LAYOUT_BUILD;
+    const char* marker = (const char*)_get(_n_items);
+    int32_t layout;
+    if (_get(_n_items)->n_descendants != 0 ||
+        memcmp(marker + sizeof(S), ANNOYLIB_LAYOUT_MAGIC, sizeof(ANNOYLIB_LAYOUT_MAGIC) - 1))
+      return ANNOYLIB_LAYOUT_BUILD;
+    memcpy(&layout, marker + sizeof(S) + sizeof(ANNOYLIB_LAYOUT_MAGIC) - 1, sizeof(layout));
+    return layout == ANNOYLIB_LAYOUT_BLOCKED ? ANNOYLIB_LAYOUT_BLOCKED : ANNOYLIB_LAYOUT_BUILD;
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    // Used when requesting distances from Python layer
-    // Turns out sometimes the squared distance is -0.0
-    // so we have to make sure it's a positive number.
-    return sqrt(std::max(distance, T(0)));
+
+  // Writes the index one tree after the other, each cut into blocks of about
+  // a page: the top of a subtree, breadth first, followed depth first by the
+  // subtrees below it. A query descending a tree then reads a page for every
+  // few levels rather than one for most nodes. Children are renumbered to
+  // match and nodes no root reaches are left out. Items keep their ids and
+  // come first, the marker next, then the trees and, as always last, the
+  // copies of the roots.
+  bool _write_blocked(FILE* f) const {
+    // trees that are a single leaf list are left as they are.
+    bool blocked = _layout_marker_fits();
+    for (size_t i = 0; i < _roots.size(); i++)
+      blocked = blocked && _roots[i] >= _n_items && _get(_roots[i])->n_descendants > _K;
+    if (!blocked)
+      return fwrite(_nodes, _s, _n_nodes, f) == (size_t)_n_nodes;
+
+    // trees in the order of their roots, which load() finds in reverse, so
+    // that saving a loaded index writes the same file again.
+    vector<S> roots(_roots);
+    std::sort(roots.begin(), roots.end());
+
+    // order[k] is the node stored at _n_items + 1 + k, position its inverse.
+    vector<S> order, position(_n_nodes, -1), subtrees(roots.rbegin(), roots.rend());
+    while (!subtrees.empty()) {
+      // the block ends with the node crossing into the next page.
+      size_t head = order.size(), below = subtrees.size() - 1;
+      size_t offset = ((size_t)_n_items + 1 + head) * _s;
+      size_t end = head + (ANNOYLIB_LAYOUT_BLOCK_BYTES - offset % ANNOYLIB_LAYOUT_BLOCK_BYTES + _s - 1) / _s;
+      order.push_back(subtrees.back());
+      subtrees.pop_back();
+      for (; head < order.size(); head++) {
+        const Node* nd = _get(order[head]);
+        if (nd->n_descendants <= _K)
+          continue;
+        for (int c = 0; c < 2; c++) {
+          if (nd->children[c] < _n_items)
+            continue;
+          if (order.size() < end)
+            order.push_back(nd->children[c]);
+          else
+            subtrees.push_back(nd->children[c]);
+        }
+      }
+      std::reverse(subtrees.begin() + below, subtrees.end());
+    }
+    for (size_t k = 0; k < order.size(); k++)
+      position[order[k]] = _n_items + 1 + (S)k;
+
+    if (fwrite(_nodes, _s, _n_items, f) != (size_t)_n_items)
+      return false;
+
+    vector<char> buffer(_s, 0);
+    int32_t layout = ANNOYLIB_LAYOUT_BLOCKED;
+    memcpy(&buffer[sizeof(S)], ANNOYLIB_LAYOUT_MAGIC, sizeof(ANNOYLIB_LAYOUT_MAGIC) - 1);
+    memcpy(&buffer[sizeof(S) + sizeof(ANNOYLIB_LAYOUT_MAGIC) - 1], &layout, sizeof(layout));
+    if (fwrite(&buffer[0], _s, 1, f) != 1)
+      return false;
+
+    Node* nd = (Node*)&buffer[0];
+    for (size_t k = 0; k < order.size() + roots.size(); k++) {
+      memcpy(nd, _get(k < order.size() ? order[k] : roots[k - order.size()]), _s);
+      if (nd->n_descendants > _K)
+        for (int c = 0; c < 2; c++)
+          if (nd->children[c] >= _n_items)
+            nd->children[c] = position[nd->children[c]];
+      if (fwrite(nd, _s, 1, f) != 1)
+        return false;
+    }
+    return true;
   }
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
+
+  void _reallocate_nodes(S n) {
+    const double reallocation_factor = 1.3;
+    S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
+    void *old = _nodes;
+    AnnoyIndexStats::add(_stats.reallocations, 1);
+    
+    if (_on_disk) {
+      if (!remap_memory_and_truncate(&_nodes, _fd, 
+          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size), 
+          static_cast<size_t>(_s) * static_cast<size_t>(new_nodes_size)) && 
+          _verbose)
+          annoylib_showUpdate("File truncation error\n");
+    } else {
+      _nodes = realloc(_nodes, _s * new_nodes_size);
+      memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+    }
+    
+    _nodes_size = new_nodes_size;
+    if (_verbose) annoylib_showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
   }
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+
+  void _allocate_size(S n) {
+    if (n > _nodes_size) {
+      _reallocate_nodes(n);
+    }
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
-    n->norm = dot(n->v, n->v, f);
+
+  Node* _get(const S i) const {
+    return get_node_ptr<S, Node>(_nodes, _s, i);
   }
-  static const char* name() {
-    return "angular";
+
+  double _split_imbalance(const vector<S>& left_indices, const vector<S>& right_indices) {
+    double ls = (float)left_indices.size();
+    double rs = (float)right_indices.size();
+    float f = ls / (ls + rs + 1e-9);  // Avoid 0/0
+    return std::max(f, 1-f);
   }
-};
 
+  S _make_tree(const vector<S>& indices, bool is_root, Random& _random, ThreadedBuildPolicy& threaded_build_policy) {
+    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
+    // There's some regrettable complications caused by the problem that root nodes have to be "special":
+    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
+    // 2. Root nodes with only 1 child need to be a "dummy" parent
+    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
+    if (indices.size() == 1 && !is_root)
+      return indices[0];
+
+    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
+      S item;
+      Node* m = _new_node(&item, threaded_build_policy);
+      m->n_descendants = is_root ? _n_items : (S)indices.size();
 
-struct DotProduct : Angular {
-  template<typename S, typename T>
-  struct Node {
-    /*
-     * This is an extension of the Angular node with an extra attribute for the scaled norm.
-     */
-    S n_descendants;
-    S children[2]; // Will possibly store more than 2
-    T dot_factor;
-    T v[ANNOYLIB_V_ARRAY_SIZE];
-  };
+      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
+      // probably because gcc 4.8 goes overboard with optimizations.
+      // Using memcpy instead of std::copy for MSVC compatibility. #235
+      // Only copy when necessary to avoid crash in MSVC 9. #293
+      if (!indices.empty())
+        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
 
-  static const char* name() {
-    return "dot";
+      return item;
+    }
+
+    // the items are not moved while trees are built, so they can be read
+    // without a lock.
+    vector<Node*> children;
+    for (size_t i = 0; i < indices.size(); i++) {
+      S j = indices[i];
+      Node* n = _get(j);
+      if (n)
+        children.push_back(n);
+    }
+
+    vector<S> children_indices[2];
+    Node* m = (Node*)alloca(_s);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+      children_indices[0].clear();
+      children_indices[1].clear();
+      D::create_split(children, _f, _s, _random, m);
+
+      for (size_t i = 0; i < indices.size(); i++) {
+        S j = indices[i];
+        Node* n = _get(j);
+        if (n) {
+          bool side = D::side(m, n->v, _f, _random);
+          children_indices[side].push_back(j);
+        } else {
+          annoylib_showUpdate("No node for index %d?\n", j);
+        }
+      }
+
+      if (_split_imbalance(children_indices[0], children_indices[1]) < 0.95)
+        break;
+    }
+
+    // If we didn't find a hyperplane, just randomize sides as a last option
+    while (_split_imbalance(children_indices[0], children_indices[1]) > 0.99) {
+      if (_verbose)
+        annoylib_showUpdate("\tNo hyperplane found (left has %ld children, right has %ld children)\n",
+          children_indices[0].size(), children_indices[1].size());
+
+      children_indices[0].clear();
+      children_indices[1].clear();
+
+      // Set the vector to 0.0
+      for (int z = 0; z < _f; z++)
+        m->v[z] = 0;
+
+      for (size_t i = 0; i < indices.size(); i++) {
+        S j = indices[i];
+        // Just randomize...
+        children_indices[_random.flip()].push_back(j);
+      }
+    }
+
+    int flip = (children_indices[0].size() > children_indices[1].size());
+
+    m->n_descendants = is_root ? _n_items : (S)indices.size();
+    if (ThreadedBuildPolicy::forks && indices.size() >= ANNOYLIB_BUILD_TASK_ITEMS) {
+      // the larger child is left for another thread to take. Each side gets
+      // a generator of its own, drawn before either is built.
+      Random randoms[2] = {Random(_random.kiss()), Random(_random.kiss())};
+      threaded_build_policy.fork(
+        [&]() {
+          m->children[flip] = _make_tree(children_indices[flip], false, randoms[flip], threaded_build_policy);
+        },
+        [&]() {
+          m->children[flip^1] = _make_tree(children_indices[flip^1], false, randoms[flip^1], threaded_build_policy);
+        });
+    } else {
+      for (int side = 0; side < 2; side++) {
+        // run _make_tree for the smallest child first (for cache locality)
+        m->children[side^flip] = _make_tree(children_indices[side^flip], false, _random, threaded_build_policy);
+      }
+    }
+
+    S item;
+    memcpy(_new_node(&item, threaded_build_policy), m, _s);
+    return item;
   }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return -dot(x->v, y->v, f);
+
+  // A node of the calling build thread's arena, numbered *item.
+  Node* _new_node(S* item, ThreadedBuildPolicy& threaded_build_policy) {
+    NodeArena& arena = _arenas[threaded_build_policy.slot()];
+    if (arena.chunks.empty() || arena.used == ANNOYLIB_ARENA_NODES) {
+      if (_on_disk && !arena.chunks.empty()) {
+        // the chunk is written out, and its memory used for the next one.
+        _write_chunk(arena);
+        memset(&arena.chunks.back()[0], 0, _s * ANNOYLIB_ARENA_NODES);
+      } else {
+        arena.chunks.push_back(vector<char>(_s * ANNOYLIB_ARENA_NODES));
+      }
+      arena.numbers.push_back(_n_chunks++);
+      arena.used = 0;
+    }
+    *item = _n_nodes + arena.numbers.back() * ANNOYLIB_ARENA_NODES + arena.used;
+    return (Node*)&arena.chunks.back()[_s * arena.used++];
   }
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    dest->dot_factor = 0;
+  // Writes the used part of the last chunk of arena to its place in the file.
+  void _write_chunk(const NodeArena& arena) {
+    const char* data = &arena.chunks.back()[0];
+    size_t size = _s * arena.used;
+    off_t offset = (off_t)_s * ((off_t)_n_nodes + (off_t)arena.numbers.back() * ANNOYLIB_ARENA_NODES);
+    while (size > 0) {
+      int64_t written = pwrite(_fd, data, size, offset);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0) {
+        _arena_errno = written < 0 ? errno : EIO;
+        return;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+    }
   }
 
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  // Nodes made so far in the arenas.
+  S _arena_nodes() const {
+    S n = 0;
+    for (size_t i = 0; i < _arenas.size(); i++)
+      if (!_arenas[i].numbers.empty())
+        n += (S)(_arenas[i].numbers.size() - 1) * ANNOYLIB_ARENA_NODES + _arenas[i].used;
+    return n;
   }
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
-    dest->dot_factor = source->dot_factor;
+  // Moves the nodes of the trees from the arenas into _nodes, numbered the
+  // way a single thread makes them: tree by tree, children before their
+  // parent and the smaller child first. The index is then laid out the
+  // same whichever threads built it.
+  bool _compact_trees(char** error) {
+    S base = _n_nodes;
+    vector<Node*> chunks(_n_chunks);
+    vector<S> moves; // on disk, where each node goes, by its arena number
+
+    if (_on_disk) {
+      for (size_t i = 0; i < _arenas.size(); i++)
+        if (!_arenas[i].chunks.empty())
+          _write_chunk(_arenas[i]);
+      _arenas.clear();
+      if (_arena_errno) {
+        errno = _arena_errno;
+        set_error_from_errno(error, "Unable to write nodes");
+        _arena_errno = 0;
+        _n_chunks = 0;
+        return false;
+      }
+
+      S extent = _n_chunks * ANNOYLIB_ARENA_NODES;
+      _allocate_size(base + extent);
+      for (S c = 0; c < (S)_n_chunks; c++)
+        chunks[c] = _get(base + c * ANNOYLIB_ARENA_NODES);
+      moves.assign(extent, -1);
+    } else {
+      for (size_t i = 0; i < _arenas.size(); i++)
+        for (size_t c = 0; c < _arenas[i].chunks.size(); c++)
+          chunks[_arenas[i].numbers[c]] = (Node*)&_arenas[i].chunks[c][0];
+      _allocate_size(_n_nodes + _arena_nodes());
+    }
+
+    for (size_t i = 0; i < _roots.size(); i++)
+      _roots[i] = _move_node(_roots[i], base, chunks, _on_disk ? &moves : NULL);
+
+    if (_on_disk)
+      _move_nodes(base, moves);
+
+    _arenas.clear();
+    _n_chunks = 0;
+    return true;
   }
 
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    DotProduct::zero_value(p); 
-    DotProduct::zero_value(q);
-    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    n->dot_factor = p->dot_factor - q->dot_factor;
-    DotProduct::normalize<T, Node<S, T> >(n, f);
+  // Renumbers node i of the arenas and its subtree, and returns its new
+  // number. The node is copied to its place in _nodes, or if moves is given,
+  // left where it is to be moved by _move_nodes.
+  S _move_node(S i, S base, const vector<Node*>& chunks, vector<S>* moves) {
+    if (i < _n_items)
+      return i;
+    S k = i - base;
+    Node* nd = get_node_ptr<S, Node>(chunks[k / ANNOYLIB_ARENA_NODES], _s, k % ANNOYLIB_ARENA_NODES);
+    if (nd->n_descendants > _K) {
+      S sizes[2];
+      for (int side = 0; side < 2; side++) {
+        S j = nd->children[side];
+        sizes[side] = j < _n_items ? 1 :
+          get_node_ptr<S, Node>(chunks[(j - base) / ANNOYLIB_ARENA_NODES], _s, (j - base) % ANNOYLIB_ARENA_NODES)->n_descendants;
+      }
+      int flip = sizes[0] > sizes[1];
+      for (int side = 0; side < 2; side++)
+        nd->children[side^flip] = _move_node(nd->children[side^flip], base, chunks, moves);
+    }
+    S item = _n_nodes++;
+    if (moves)
+      (*moves)[k] = item - base;
+    else
+      memcpy(_get(item), nd, _s);
+    return item;
   }
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
-      node->dot_factor /= norm;
+  // Moves each node base + k of _nodes to base + moves[k], following each
+  // cycle of moves with one node in hand. -1 marks a place with nothing to
+  // move, or whose node has been moved already.
+  void _move_nodes(S base, vector<S>& moves) {
+    vector<char> carried(_s), displaced(_s);
+    for (S k = 0; k < (S)moves.size(); k++) {
+      if (moves[k] < 0)
+        continue;
+      S to = moves[k];
+      moves[k] = -1;
+      if (to == k)
+        continue;
+      memcpy(&carried[0], _get(base + k), _s);
+      while (moves[to] >= 0) {
+        S next = moves[to];
+        moves[to] = -1;
+        memcpy(&displaced[0], _get(base + to), _s);
+        memcpy(_get(base + to), &carried[0], _s);
+        carried.swap(displaced);
+        to = next;
+      }
+      memcpy(_get(base + to), &carried[0], _s);
+    }
+  }
+
+  void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    AnnoyQueryState<S, T>* state = AnnoyQueryContext<S, T>::local().reuse_whole();
+    _query_begin(state, v, n, search_k);
+    _query_advance(state, numeric_limits<size_t>::max());
+    _query_finish(state, result, distances);
+  }
+
+  void _query_begin(AnnoyQueryState<S, T>* state, const T* v, size_t n, int search_k) const {
+    state->query.resize(_s);
+    Node* v_node = (Node *)&state->query[0];
+    D::template zero_value<Node>(v_node);
+    memcpy(v_node->v, v, sizeof(T) * _f);
+    D::init_node(v_node, _f);
+
+    if (search_k == -1) {
+      search_k = n * _roots.size();
+    }
+
+    state->phase = AnnoyQueryState<S, T>::TRAVERSE;
+    state->n = n;
+    state->search_k = (size_t)search_k;
+    state->q.clear();
+    state->begin_candidates(_n_items);
+    state->nns_dist.clear();
+    state->scored = 0;
+    state->keep = n;
+    state->started = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < _roots.size(); i++) {
+      state->q.push_back(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
     }
+    std::make_heap(state->q.begin(), state->q.end());
   }
 
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  // Runs the query for at most max_steps visited nodes or scored candidates.
+  // Returns true once there is nothing left to do but _query_finish.
+  bool _query_advance(AnnoyQueryState<S, T>* state, size_t max_steps) const {
+    uint64_t visited = 0, evaluated = 0, duplicates = 0;
+
+    for (; max_steps > 0; max_steps--)
+      if (!_query_step<false>(state, visited, evaluated, duplicates))
+        break;
+
+    AnnoyIndexStats::add(_stats.visited_nodes, visited);
+    AnnoyIndexStats::add(_stats.distance_evaluations, evaluated);
+    AnnoyIndexStats::add(_stats.duplicates, duplicates);
+    return state->phase == AnnoyQueryState<S, T>::DONE;
   }
 
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+  // Takes a step of each query in flight in turn, like a round of
+  // coroutines. Each step prefetches the node its query needs next, which
+  // then has the steps of the other queries to arrive, instead of every
+  // step waiting on a cache miss of its own.
+  void _query_advance_all(AnnoyQueryState<S, T>* const* states, size_t count) const {
+    AnnoyQueryState<S, T>* active[ANNOYLIB_INTERLEAVE];
+    size_t n_active = 0, next = 0;
+    uint64_t visited = 0, evaluated = 0, duplicates = 0;
+
+    while (n_active > 0 || next < count) {
+      while (n_active < ANNOYLIB_INTERLEAVE && next < count)
+        active[n_active++] = states[next++];
+      for (size_t k = 0; k < n_active;) {
+        if (_query_step<true>(active[k], visited, evaluated, duplicates))
+          k++;
+        else
+          active[k] = active[--n_active];
+      }
+    }
+
+    AnnoyIndexStats::add(_stats.visited_nodes, visited);
+    AnnoyIndexStats::add(_stats.distance_evaluations, evaluated);
+    AnnoyIndexStats::add(_stats.duplicates, duplicates);
   }
 
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return -distance;
+  void _prefetch(S i) const {
+    const char* p = (const char*)_get(i);
+    for (size_t offset = 0; offset < _s; offset += 64)
+      ANNOYLIB_PREFETCH(p + offset);
   }
 
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
-    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+  // Visits a node or scores a candidate. Returns false once the query is
+  // done. With Prefetch, the node or candidate of the next step is
+  // prefetched.
+  template<bool Prefetch>
+  bool _query_step(AnnoyQueryState<S, T>* state, uint64_t& visited, uint64_t& evaluated,
+                   uint64_t& duplicates) const {
+    const Node* v_node = (const Node *)&state->query[0];
+    vector<pair<T, S> >& q = state->q;
+    vector<S>& nns = state->nns;
+
+    if (state->phase == AnnoyQueryState<S, T>::TRAVERSE) {
+      if (state->found >= state->search_k || q.empty()) {
+        // Get distances for all items. Duplicates were skipped as they
+        // were found, so each is computed once.
+        state->phase = AnnoyQueryState<S, T>::SCORE;
+        if (Prefetch && !nns.empty())
+          _prefetch(nns[0]);
+        return true;
+      }
 
-    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T d = dot(node->v, node->v, f);
-      T norm = d < 0 ? 0 : sqrt(d);
-      node->dot_factor = norm;
-    }
+      std::pop_heap(q.begin(), q.end());
+      T d = q.back().first;
+      S i = q.back().second;
+      q.pop_back();
+      visited++;
+      Node* nd = _get(i);
+      if (nd->n_descendants == 1 && i < _n_items) {
+        if (state->passes(i) && !state->add_candidate(i))
+          duplicates++;
+      } else if (nd->n_descendants <= _K) {
+        const S* dst = nd->children;
+        for (S k = 0; k < nd->n_descendants; k++)
+          if (state->passes(dst[k]) && !state->add_candidate(dst[k]))
+            duplicates++;
+      } else {
+        T margin = D::margin(nd, v_node->v, _f);
+        q.push_back(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
+        std::push_heap(q.begin(), q.end());
+        q.push_back(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
+        std::push_heap(q.begin(), q.end());
+      }
+      if (Prefetch && !q.empty())
+        _prefetch(q.front().second);
+      return true;
+    } else if (state->phase == AnnoyQueryState<S, T>::SCORE) {
+      if (state->scored == nns.size()) {
+        state->phase = AnnoyQueryState<S, T>::DONE;
+        return false;
+      }
 
-    // Step two: find the maximum norm
-    T max_norm = 0;
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      if (node->dot_factor > max_norm) {
-        max_norm = node->dot_factor;
+      S j = nns[state->scored++];
+      if (Prefetch && state->scored < nns.size())
+        _prefetch(nns[state->scored]);
+      if (_get(j)->n_descendants == 1) { // This is only to guard a really obscure case, #284
+        // a distance past the bound is abandoned, and then not kept either.
+        state->offer(BoundedDistance<D>::distance(v_node, _get(j), _f, state->bound()), j);
+        evaluated++;
       }
+      return true;
     }
+    return false;
+  }
 
-    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T node_norm = node->dot_factor;
-      T squared_norm_diff = pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0));
-      T dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
-
-      node->dot_factor = dot_factor;
+  void _query_finish(AnnoyQueryState<S, T>* state, vector<S>* result, vector<T>* distances) const {
+    vector<pair<T, S> >& nns_dist = state->nns_dist;
+    std::sort_heap(nns_dist.begin(), nns_dist.end());
+    for (size_t i = 0; i < nns_dist.size(); i++) {
+      if (distances)
+        distances->push_back(D::normalized_distance(nns_dist[i].first));
+      result->push_back(nns_dist[i].second);
     }
+
+    AnnoyIndexStats::add(_stats.queries, 1);
+    _stats.add_latency(AnnoyIndexStats::elapsed_us(state->started));
   }
 };
 
-struct Hamming : Base {
-  template<typename S, typename T>
-  struct Node {
-    S n_descendants;
-    S children[2];
-    T v[ANNOYLIB_V_ARRAY_SIZE];
-  };
+class AnnoyIndexSingleThreadedBuildPolicy {
+public:
+  // Calls f with a policy to build with.
+  template<typename F>
+  static void run(int n_threads, F f) {
+    AnnoyIndexSingleThreadedBuildPolicy threaded_build_policy;
+    f(threaded_build_policy);
+  }
 
-  static const size_t max_iterations = 20;
+  template<typename S, typename T, typename D, typename Random>
+  void build(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, int q) {
+    annoy->thread_build(q, 0, *this);
+  }
 
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    return distance - (margin != (unsigned int) child_nr);
+  template<typename F>
+  static void parallel_for(size_t n, int n_threads, F f) {
+    f((size_t)0, n);
   }
 
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::max();
+  template<typename F>
+  void parallel_for(size_t n, F f) {
+    f((size_t)0, n);
   }
-  template<typename T>
-  static inline int cole_popcount(T v) {
-    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
-    // calculate std::bitset::count for v > 32bit. Uses the generalized
-    // approach by Eric Cole.
-    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
-    v = v - ((v >> 1) & (T)~(T)0/3);
-    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
-    v = (v + (v >> 4)) & (T)~(T)0/255*15;
-    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
+
+  static const bool forks = false;
+
+  template<typename F0, typename F1>
+  void fork(F0 f0, F1 f1) {
+    f0();
+    f1();
   }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    size_t dist = 0;
-    for (int i = 0; i < f; i++) {
-      dist += annoylib_popcount(x->v[i] ^ y->v[i]);
-    }
-    return dist;
+
+  template<typename F>
+  void for_each(size_t n, F f) {
+    for (size_t i = 0; i < n; i++)
+      f(i);
   }
-  template<typename S, typename T>
-  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
-    static const size_t n_bits = sizeof(T) * 8;
-    T chunk = n->v[0] / n_bits;
-    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
+
+  size_t slot() const { return 0; }
+  size_t n_slots() const { return 1; }
+};
+
+#ifdef ANNOYLIB_MULTITHREADED_BUILD
+class AnnoyBuildPool {
+  /*
+   * Build threads, each with a deque of tasks. A thread pushes the tasks
+   * it spawns onto its own deque and takes them back last in, first out,
+   * so it goes on with the subtree it has just split while it is in
+   * cache. Idle threads steal the oldest task of another thread, the
+   * largest subtree it has left, so a few steals spread a tree over all
+   * of them. A worker waiting for its tasks runs other tasks meanwhile;
+   * other threads only submit work and sleep until it is done.
+   */
+public:
+  struct Group {
+    std::atomic<size_t> pending;
+    Group() : pending(0) {}
+  };
+
+  explicit AnnoyBuildPool(int n_threads) : _queues(std::max(1, n_threads)), _queued(0), _stop(false) {
+    try {
+      for (size_t i = 0; i < _queues.size(); i++)
+        _threads.push_back(std::thread(&AnnoyBuildPool::_work, this, i));
+    } catch (const std::system_error&) {
+      // carry on with the threads we have.
+      if (_threads.empty())
+        throw;
+    }
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    return margin(n, y, f);
+
+  ~AnnoyBuildPool() {
+    {
+      std::lock_guard<std::mutex> lock(_idle_mutex);
+      _stop = true;
+    }
+    _idle.notify_all();
+    for (auto& thread : _threads)
+      thread.join();
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    size_t cur_size = 0;
-    size_t i = 0;
-    int dim = f * 8 * sizeof(T);
-    for (; i < max_iterations; i++) {
-      // choose random position to split at
-      n->v[0] = random.index(dim);
-      cur_size = 0;
-      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-        if (margin(n, (*it)->v, f)) {
-          cur_size++;
-        }
-      }
-      if (cur_size > 0 && cur_size < nodes.size()) {
-        break;
-      }
+
+  void spawn(Group& group, std::function<void()> task) {
+    group.pending++;
+    Queue& queue = _queues[_worker().pool == this ? _worker().queue : 0];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(Task(std::move(task), &group));
     }
-    // brute-force search for splitting coordinate
-    if (i == max_iterations) {
-      int j = 0;
-      for (; j < dim; j++) {
-        n->v[0] = j;
-        cur_size = 0;
-        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-          if (margin(n, (*it)->v, f)) {
-            cur_size++;
-          }
-        }
-        if (cur_size > 0 && cur_size < nodes.size()) {
-          break;
-        }
-      }
+    _queued++;
+    {
+      std::lock_guard<std::mutex> lock(_idle_mutex);
     }
+    _idle.notify_one();
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return distance;
-  }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+
+  void wait(Group& group) {
+    if (_worker().pool == this) {
+      while (group.pending > 0)
+        if (!_run_one(_worker().queue))
+          std::this_thread::yield();
+    } else {
+      std::unique_lock<std::mutex> lock(_idle_mutex);
+      _done.wait(lock, [&group]() { return group.pending == 0; });
+    }
   }
-  static const char* name() {
-    return "hamming";
+
+  // A number for the calling thread: its queue if it is a worker, and
+  // n_slots() - 1 for any other thread.
+  size_t slot() const {
+    return _worker().pool == this ? _worker().queue : _queues.size();
   }
-};
+  size_t n_slots() const { return _queues.size() + 1; }
 
+private:
+  typedef std::pair<std::function<void()>, Group*> Task;
 
-struct Minkowski : Base {
-  template<typename S, typename T>
-  struct Node {
-    S n_descendants;
-    T a; // need an extra constant term to determine the offset of the plane
-    S children[2];
-    T v[ANNOYLIB_V_ARRAY_SIZE];
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
   };
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return n->a + dot(n->v, y, f);
+
+  vector<Queue> _queues;
+  vector<std::thread> _threads;
+  std::atomic<size_t> _queued;
+  bool _stop;
+  std::mutex _idle_mutex;
+  std::condition_variable _idle; // tasks were queued, or the pool stops
+  std::condition_variable _done; // a group has no tasks left
+
+  // the pool and queue of the calling thread, if it is a worker.
+  struct Worker {
+    AnnoyBuildPool* pool;
+    size_t queue;
+  };
+
+  static Worker& _worker() {
+    static thread_local Worker worker = {NULL, 0};
+    return worker;
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+
+  bool _take(size_t self, Task* task) {
+    for (size_t k = 0; k < _queues.size(); k++) {
+      Queue& queue = _queues[(self + k) % _queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      if (k == 0) {
+        *task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        *task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      _queued--;
+      return true;
+    }
+    return false;
   }
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
+
+  bool _run_one(size_t self) {
+    Task task;
+    if (!_take(self, &task))
+      return false;
+    task.first();
+    if (--task.second->pending == 0) {
+      std::lock_guard<std::mutex> lock(_idle_mutex);
+      _done.notify_all();
+    }
+    return true;
   }
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+
+  void _work(size_t self) {
+    _worker().pool = this;
+    _worker().queue = self;
+    while (true) {
+      if (_run_one(self))
+        continue;
+      std::unique_lock<std::mutex> lock(_idle_mutex);
+      _idle.wait(lock, [this]() { return _stop || _queued > 0; });
+      if (_stop && _queued == 0)
+        return;
+    }
   }
 };
 
+class AnnoyIndexMultiThreadedBuildPolicy {
+private:
+  AnnoyBuildPool* pool;
+
+  explicit AnnoyIndexMultiThreadedBuildPolicy(AnnoyBuildPool* pool) : pool(pool) {}
 
-struct Euclidean : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return euclidean_distance(x->v, y->v, f);    
+  static int _threads(int n_threads) {
+    // If the hardware_concurrency() value is not well defined or not computable, it returns 0.
+    // We guard against this by using at least 1 thread.
+    return n_threads == -1 ? std::max(1, (int)std::thread::hardware_concurrency()) : n_threads;
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  // Ranges shorter than this are not worth a task.
+  static const size_t min_chunk = 1024;
+
+public:
+  // Calls f with a policy whose tasks run on a pool of n_threads threads,
+  // kept for as long as f runs.
+  template<typename F>
+  static void run(int n_threads, F f) {
+    AnnoyBuildPool pool(_threads(n_threads));
+    AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy(&pool);
+    f(threaded_build_policy);
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return sqrt(std::max(distance, T(0)));
+
+  // Subtrees, as well as trees, are tasks on the pool.
+  template<typename S, typename T, typename D, typename Random>
+  void build(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, int q) {
+    annoy->build_trees(q, *this);
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+
+  // parallel_for on a pool of its own, for work outside of a build. The
+  // pool is only started if n is large enough to be split.
+  template<typename F>
+  static void parallel_for(size_t n, int n_threads, F f) {
+    n_threads = _threads(n_threads);
+    if (n_threads <= 1 || n < 2 * min_chunk) {
+      f((size_t)0, n);
+      return;
+    }
+    run(n_threads, [&](AnnoyIndexMultiThreadedBuildPolicy& threaded_build_policy) {
+      threaded_build_policy.parallel_for(n, f);
+    });
   }
-  static const char* name() {
-    return "euclidean";
+
+  // Calls f(begin, end) over [0, n) split into contiguous chunks, a few per
+  // thread, as tasks on the pool.  Small ranges, or a pool of one thread,
+  // run on the caller.
+  template<typename F>
+  void parallel_for(size_t n, F f) {
+    size_t n_threads = pool->n_slots() - 1;
+    size_t n_chunks = std::min(n_threads * 4, (n + min_chunk - 1) / min_chunk);
+    if (n_threads <= 1 || n_chunks <= 1) {
+      f((size_t)0, n);
+      return;
+    }
+
+    AnnoyBuildPool::Group group;
+    for (size_t c = 0; c < n_chunks; c++) {
+      pool->spawn(group, [&f, n, c, n_chunks]() { f(n * c / n_chunks, n * (c + 1) / n_chunks); });
+    }
+    pool->wait(group);
   }
 
-};
+  static const bool forks = true;
 
-struct Manhattan : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return manhattan_distance(x->v, y->v, f);
+  // Runs f0 and f1, f1 as a task another thread can take.
+  template<typename F0, typename F1>
+  void fork(F0 f0, F1 f1) {
+    AnnoyBuildPool::Group group;
+    pool->spawn(group, f1);
+    f0();
+    pool->wait(group);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  // Runs f(i) for each i in [0, n) as a task, and returns once all are done.
+  template<typename F>
+  void for_each(size_t n, F f) {
+    AnnoyBuildPool::Group group;
+    for (size_t i = 0; i < n; i++) {
+      pool->spawn(group, [&f, i]() { f(i); });
+    }
+    pool->wait(group);
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return std::max(distance, T(0));
+
+  // The arena of the calling thread: one per worker, and the last for
+  // the thread that started the build.
+  size_t slot() const { return pool->slot(); }
+  size_t n_slots() const { return pool->n_slots(); }
+};
+#endif
+
+// What D::distance gives for a query q and a quantized item, computed on
+// the codes. q_sum and q_norm are the sum and the squared norm of q.
+template<typename D, typename C>
+struct QuantizedDistance;
+
+template<typename C>
+struct QuantizedDistance<Angular, C> {
+  static float distance(const float* q, float q_sum, float q_norm, const AnnoyQuantizedItem<C>* x, int f) {
+    float pq = x->offset * q_sum + x->scale * AnnoyCodec<C>::dot(q, x->codes, f);
+    float ppqq = q_norm * x->norm;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0;
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+};
+
+template<typename C>
+struct QuantizedDistance<DotProduct, C> {
+  static float distance(const float* q, float q_sum, float q_norm, const AnnoyQuantizedItem<C>* x, int f) {
+    return -(x->offset * q_sum + x->scale * AnnoyCodec<C>::dot(q, x->codes, f));
   }
-  static const char* name() {
-    return "manhattan";
+};
+
+// Scored on the differences rather than through the norms, which would lose
+// all precision for items far from the origin and close to each other.
+template<typename C>
+struct QuantizedDistance<Euclidean, C> {
+  static float distance(const float* q, float q_sum, float q_norm, const AnnoyQuantizedItem<C>* x, int f) {
+    return AnnoyCodec<C>::euclidean_distance(q, x->codes, x->offset, x->scale, f);
   }
 };
 
-template<typename S, typename T, typename R = uint64_t>
-class AnnoyIndexInterface {
+template<typename C>
+struct QuantizedDistance<Manhattan, C> {
+  static float distance(const float* q, float q_sum, float q_norm, const AnnoyQuantizedItem<C>* x, int f) {
+    return AnnoyCodec<C>::manhattan_distance(q, x->codes, x->offset, x->scale, f);
+  }
+};
+
+template<typename S, typename T>
+class AnnoyQuantizedIndexInterface : public AnnoyIndexInterface<S, T> {
  public:
-  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
-  virtual ~AnnoyIndexInterface() {};
-  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
-  virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
-  virtual bool unbuild(char** error=NULL) = 0;
-  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual void unload() = 0;
-  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual T get_distance(S i, S j) const = 0;
-  virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual S get_n_items() const = 0;
-  virtual S get_n_trees() const = 0;
-  virtual void verbose(bool v) = 0;
-  virtual void get_item(S item, T* v) const = 0;
-  virtual void set_seed(R q) = 0;
-  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
+  // The float vectors written next to the index by save_quantized, to rerank
+  // the closest candidates of each query with.
+  virtual bool load_vectors(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  // How many candidates to rerank per result asked for, 0 not to rerank.
+  virtual void set_rerank_factor(size_t factor) = 0;
 };
 
-template<typename S, typename T, typename Distance, typename Random, class ThreadedBuildPolicy>
-  class AnnoyIndex : public AnnoyIndexInterface<S, T, 
-#if __cplusplus >= 201103L
-    typename std::remove_const<decltype(Random::default_seed)>::type
-#else
-    typename Random::seed_type
-#endif
-    > {
+template<typename S, typename T, typename D, typename C=int8_t>
+class AnnoyQuantizedIndex : public AnnoyQuantizedIndexInterface<S, T> {
   /*
-   * We use random projection to build a forest of binary trees of all items.
-   * Basically just split the hyperspace into two sides by a hyperplane,
-   * then recursively split each of those subtrees etc.
-   * We create a tree like this q times. The default q is determined automatically
-   * in such a way that we at most use 2x as much memory as the vectors take.
+   * A read-only copy of a built index, written by save_quantized, whose
+   * item vectors and split planes are stored as codes C, and whose leaf
+   * lists are packed together: about a quarter of the size for int8 codes
+   * and half for float16 or bfloat16, for large f. Queries walk the trees
+   * and score candidates on the codes. With C = float nothing is lost, and
+   * only the split layout is kept.
+   * If the float vectors are loaded as well, the n * rerank_factor closest
+   * candidates are then scored again on those, which makes up for most of
+   * the precision lost.
+   *
+   * Files written by save_pq have float16 planes and product quantized
+   * items instead, scored with a per query table of distances to the
+   * centroids. They load with C = annoy_float16.
    */
 public:
-  typedef Distance D;
   typedef typename D::template Node<S, T> Node;
-#if __cplusplus >= 201103L
-  typedef typename std::remove_const<decltype(Random::default_seed)>::type R;
-#else
-  typedef typename Random::seed_type R;
-#endif
 
 protected:
   const int _f;
-  size_t _s;
+  size_t _s; // size of a float node, for queries
+  size_t _item_size;
+  size_t _plane_size;
+  void* _data;
+  size_t _data_size;
+  const AnnoyQuantizedHeader* _header;
+  const S* _roots;
+  const S* _children;
+  const char* _items;
+  const AnnoyQuantizedNode* _nodes;
+  const char* _planes;
+  const T* _codebook; // if product quantized
+  int _subvectors;
+  vector<T> _centroid_norms; // squared norm of each centroid
   S _n_items;
-  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
-  S _n_nodes;
-  S _nodes_size;
-  vector<S> _roots;
-  S _K;
-  R _seed;
-  bool _loaded;
+  void* _vectors;
+  size_t _vectors_size;
+  size_t _rerank_factor;
   bool _verbose;
-  int _fd;
-  bool _on_disk;
-  bool _built;
-public:
+  mutable AnnoyIndexStats _stats;
 
-   AnnoyIndex(int f) : _f(f), _seed(Random::default_seed) {
-    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
-    _verbose = false;
-    _built = false;
-    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
-    reinitialize(); // Reset everything
-  }
-  ~AnnoyIndex() {
-    unload();
+public:
+  AnnoyQuantizedIndex(int f) : _f(f), _data(NULL), _data_size(0), _header(NULL), _codebook(NULL), _subvectors(0), _n_items(0),
+                               _vectors(NULL), _vectors_size(0), _rerank_factor(0), _verbose(false) {
+    static_assert(std::is_same<T, float>::value, "quantized indexes only hold float vectors");
+    _s = offsetof(Node, v) + _f * sizeof(T);
+    _item_size = quantized_size<C>(offsetof(AnnoyQuantizedItem<C>, codes), f);
+    _plane_size = quantized_size<C>(offsetof(AnnoyQuantizedPlane<C>, codes), f);
   }
 
-  int get_f() const {
-    return _f;
+  ~AnnoyQuantizedIndex() {
+    unload();
   }
 
   bool add_item(S item, const T* w, char** error=NULL) {
-    return add_item_impl(item, w, error);
+    return _read_only(error);
   }
 
-  template<typename W>
-  bool add_item_impl(S item, const W& w, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't add an item to a loaded index");
-      return false;
-    }
-    _allocate_size(item + 1);
-    Node* n = _get(item);
-
-    D::zero_value(n);
-
-    n->children[0] = 0;
-    n->children[1] = 0;
-    n->n_descendants = 1;
-
-    for (int z = 0; z < _f; z++)
-      n->v[z] = w[z];
-
-    D::init_node(n, _f);
+  bool add_items(const S* items, S first, const T* w, size_t n, int n_threads=-1, char** error=NULL) {
+    return _read_only(error);
+  }
 
-    if (item >= _n_items)
-      _n_items = item + 1;
+  bool build(int q, int n_threads=-1, char** error=NULL) {
+    return _read_only(error);
+  }
 
-    return true;
+  bool unbuild(char** error=NULL) {
+    return _read_only(error);
   }
-    
-  bool on_disk_build(const char* file, char** error=NULL) {
-    _on_disk = true;
-    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
+
+  // Writes a copy of the mapped file.
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    if (!_data) {
+      set_error_from_string(error, "You can't save a quantized index that isn't loaded");
       return false;
     }
-    _nodes_size = 1;
-    if (ftruncate(_fd, ANNOYLIB_FTRUNCATE_SIZE(_s) * ANNOYLIB_FTRUNCATE_SIZE(_nodes_size)) == -1) {
-      set_error_from_errno(error, "Unable to truncate");
+    unlink(filename);
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
       return false;
     }
-#ifdef MAP_POPULATE
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
-#else
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
-#endif
-    return true;
-  }
-    
-  bool build(int q, int n_threads=-1, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't build a loaded index");
+    if (fwrite(_data, 1, _data_size, f) != _data_size) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
       return false;
     }
-
-    if (_built) {
-      set_error_from_string(error, "You can't build a built index");
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
       return false;
     }
-
-    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
-
-    _n_nodes = _n_items;
-
-    ThreadedBuildPolicy::template build<S, T>(this, q, n_threads);
-
-    // Also, copy the roots into the last segment of the array
-    // This way we can load them faster without reading the whole file
-    _allocate_size(_n_nodes + (S)_roots.size());
-    for (size_t i = 0; i < _roots.size(); i++)
-      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
-    _n_nodes += _roots.size();
-
-    if (_verbose) annoylib_showUpdate("has %d nodes\n", _n_nodes);
-    
-    if (_on_disk) {
-      if (!remap_memory_and_truncate(&_nodes, _fd,
-          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
-          static_cast<size_t>(_s) * static_cast<size_t>(_n_nodes))) {
-        // TODO: this probably creates an index in a corrupt state... not sure what to do
-        set_error_from_errno(error, "Unable to truncate");
-        return false;
-      }
-      _nodes_size = _n_nodes;
-    }
-    _built = true;
     return true;
   }
-  
-  bool unbuild(char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't unbuild a loaded index");
-      return false;
-    }
-
-    _roots.clear();
-    _n_nodes = _n_items;
-    _built = false;
 
-    return true;
+  bool save_quantized(const char* filename, AnnoyElementType element,
+                      const char* vectors_filename=NULL, char** error=NULL) {
+    return _read_only(error);
   }
 
-  bool save(const char* filename, bool prefault=false, char** error=NULL) {
-    if (!_built) {
-      set_error_from_string(error, "You can't save an index that hasn't been built");
-      return false;
-    }
-    if (_on_disk) {
-      return true;
-    } else {
-      // Delete file if it already exists (See issue #335)
-      unlink(filename);
-
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL) {
-        set_error_from_errno(error, "Unable to open");
-        return false;
-      }
-
-      if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
-        set_error_from_errno(error, "Unable to write");
-        return false;
-      }
-
-      if (fclose(f) == EOF) {
-        set_error_from_errno(error, "Unable to close");
-        return false;
-      }
-
-      unload();
-      return load(filename, prefault, error);
-    }
+  bool save_pq(const char* filename, int subvectors, const char* vectors_filename=NULL, char** error=NULL) {
+    return _read_only(error);
   }
 
-  void reinitialize() {
-    _fd = 0;
-    _nodes = NULL;
-    _loaded = false;
-    _n_items = 0;
-    _n_nodes = 0;
-    _nodes_size = 0;
-    _on_disk = false;
-    _seed = Random::default_seed;
-    _roots.clear();
+  bool on_disk_build(const char* filename, char** error=NULL) {
+    return _read_only(error);
   }
 
   void unload() {
-    if (_on_disk && _fd) {
-      close(_fd);
-      munmap(_nodes, _s * _nodes_size);
-    } else {
-      if (_fd) {
-        // we have mmapped data
-        close(_fd);
-        munmap(_nodes, _n_nodes * _s);
-      } else if (_nodes) {
-        // We have heap allocated data
-        free(_nodes);
-      }
-    }
-    reinitialize();
-    if (_verbose) annoylib_showUpdate("unloaded\n");
+    if (_data)
+      munmap(_data, _data_size);
+    if (_vectors)
+      munmap(_vectors, _vectors_size);
+    _data = NULL;
+    _vectors = NULL;
+    _header = NULL;
+    _codebook = NULL;
+    _subvectors = 0;
+    _n_items = 0;
   }
 
   bool load(const char* filename, bool prefault=false, char** error=NULL) {
-    _fd = open(filename, O_RDONLY, (int)0400);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
+    unload();
+    if (!(_data = _map(filename, prefault, &_data_size, error)))
+      return false;
+
+    const AnnoyQuantizedHeader* h = (const AnnoyQuantizedHeader*)_data;
+    if (_data_size < sizeof(AnnoyQuantizedHeader) || memcmp(h->magic, ANNOYLIB_QUANTIZED_MAGIC, sizeof(h->magic)) || h->version != 3) {
+      set_error_from_string(error, "Not a quantized index");
+      unload();
       return false;
     }
-    off_t size = lseek_getsize(_fd);
-    if (size == -1) {
-      set_error_from_errno(error, "Unable to get size");
+    if (h->f != _f || strncmp(h->metric, D::name(), sizeof(h->metric)) || h->element != AnnoyCodec<C>::element) {
+      set_error_from_string(error, "Quantized index was saved with another metric, element type or number of dimensions");
+      unload();
       return false;
-    } else if (size == 0) {
-      set_error_from_errno(error, "Size of file is zero");
+    }
+    if (h->subvectors < 0 || (h->subvectors && _f % h->subvectors)) {
+      set_error_from_string(error, "Quantized index has a bad number of subvectors");
+      unload();
       return false;
-    } else if (size % _s) {
-      // Something is fishy with this index!
-      set_error_from_errno(error, "Index size is not a multiple of vector size. Ensure you are opening using the same metric you used to create the index.");
+    }
+    size_t items_size = h->subvectors ? pq_items_size(h->n_items, h->subvectors) : _item_size * h->n_items;
+    size_t codebook_size = h->subvectors ? sizeof(T) * ANNOYLIB_PQ_CENTROIDS * _f : 0;
+    if (h->n_items < 0 || h->n_nodes < 0 || h->n_planes < 0 || h->n_roots < 0 || h->n_children < 0 ||
+        _data_size != sizeof(AnnoyQuantizedHeader) + sizeof(S) * ((size_t)h->n_roots + h->n_children) +
+                      items_size + sizeof(AnnoyQuantizedNode) * h->n_nodes +
+                      _plane_size * h->n_planes + codebook_size) {
+      set_error_from_string(error, "Quantized index size does not match its header");
+      unload();
       return false;
     }
 
-    int flags = MAP_SHARED;
-    if (prefault) {
-#ifdef MAP_POPULATE
-      flags |= MAP_POPULATE;
-#else
-      annoylib_showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
-#endif
+    _header = h;
+    _n_items = h->n_items;
+    _roots = (const S*)(h + 1);
+    _children = _roots + h->n_roots;
+    _items = (const char*)(_children + h->n_children);
+    _nodes = (const AnnoyQuantizedNode*)(_items + items_size);
+    _planes = (const char*)(_nodes + h->n_nodes);
+    _subvectors = h->subvectors;
+    if (_subvectors) {
+      _codebook = (const T*)(_planes + _plane_size * h->n_planes);
+      _centroid_norms.resize(ANNOYLIB_PQ_CENTROIDS * _subvectors);
+      int d = _f / _subvectors;
+      for (size_t c = 0; c < _centroid_norms.size(); c++)
+        _centroid_norms[c] = dot(_codebook + c * d, _codebook + c * d, d);
     }
-    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
-    _n_nodes = (S)(size / _s);
-
-    // Find the roots by scanning the end of the file and taking the nodes with most descendants
-    _roots.clear();
-    S m = -1;
-    for (S i = _n_nodes - 1; i >= 0; i--) {
-      S k = _get(i)->n_descendants;
-      if (m == -1 || k == m) {
-        _roots.push_back(i);
-        m = k;
-      } else {
-        break;
-      }
+    if (_verbose) annoylib_showUpdate("found %d roots over %d items\n", h->n_roots, h->n_items);
+    return true;
+  }
+
+  bool load_vectors(const char* filename, bool prefault=false, char** error=NULL) {
+    if (_vectors)
+      munmap(_vectors, _vectors_size);
+    if (!(_vectors = _map(filename, prefault, &_vectors_size, error)))
+      return false;
+    if (_vectors_size != sizeof(T) * _f * (size_t)_n_items) {
+      set_error_from_string(error, "Vectors file does not match the quantized index");
+      munmap(_vectors, _vectors_size);
+      _vectors = NULL;
+      return false;
     }
-    // hacky fix: since the last root precedes the copy of all roots, delete it
-    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
-      _roots.pop_back();
-    _loaded = true;
-    _built = true;
-    _n_items = m;
-    if (_verbose) annoylib_showUpdate("found %lu roots with degree %d\n", _roots.size(), m);
     return true;
   }
 
+  void set_rerank_factor(size_t factor) {
+    _rerank_factor = factor;
+  }
+
   T get_distance(S i, S j) const {
-    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+    Node* x = (Node*)alloca(_s);
+    Node* y = (Node*)alloca(_s);
+    _get_node(i, x);
+    _get_node(j, y);
+    return D::normalized_distance(D::distance(x, y, _f));
   }
 
   void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
-    // TODO: handle OOB
-    const Node* m = _get(item);
-    _get_all_nns(m->v, n, search_k, result, distances);
+    T* v = (T*)alloca(_f * sizeof(T));
+    get_item(item, v);
+    _get_all_nns(v, n, search_k, result, distances);
   }
 
   void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
     _get_all_nns(w, n, search_k, result, distances);
   }
 
-  S get_n_items() const {
-    return _n_items;
+  void query_begin_by_item(AnnoyQueryState<S, T>* state, S item, size_t n, int search_k) const {
+    T* v = (T*)alloca(_f * sizeof(T));
+    get_item(item, v);
+    _query_begin(state, v, n, search_k);
   }
 
-  S get_n_trees() const {
-    return (S)_roots.size();
+  void query_begin_by_vector(AnnoyQueryState<S, T>* state, const T* w, size_t n, int search_k) const {
+    _query_begin(state, w, n, search_k);
   }
 
-  void verbose(bool v) {
-    _verbose = v;
+  bool query_advance(AnnoyQueryState<S, T>* state, size_t max_steps) const {
+    return _query_advance(state, max_steps);
   }
 
-  void get_item(S item, T* v) const {
-    // TODO: handle OOB
-    Node* m = _get(item);
-    memcpy(v, m->v, (_f) * sizeof(T));
+  void query_finish(AnnoyQueryState<S, T>* state, vector<S>* result, vector<T>* distances) const {
+    _query_finish(state, result, distances);
   }
 
-  void set_seed(R seed) {
-    _seed = seed;
+  // The nodes and planes of this index are small and together, so queries
+  // are simply run one after the other.
+  void query_advance_all(AnnoyQueryState<S, T>* const* states, size_t count) const {
+    for (size_t i = 0; i < count; i++)
+      _query_advance(states[i], numeric_limits<size_t>::max());
   }
 
-  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
-    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
-    Random _random(_seed + thread_idx);
-
-    vector<S> thread_roots;
-    while (1) {
-      if (q == -1) {
-        threaded_build_policy.lock_n_nodes();
-        if (_n_nodes >= 2 * _n_items) {
-          threaded_build_policy.unlock_n_nodes();
-          break;
-        }
-        threaded_build_policy.unlock_n_nodes();
-      } else {
-        if (thread_roots.size() >= (size_t)q) {
-          break;
-        }
-      }
-
-      if (_verbose) annoylib_showUpdate("pass %zd...\n", thread_roots.size());
-
-      vector<S> indices;
-      threaded_build_policy.lock_shared_nodes();
-      for (S i = 0; i < _n_items; i++) {
-        if (_get(i)->n_descendants >= 1) { // Issue #223
-          indices.push_back(i);
-        }
-      }
-      threaded_build_policy.unlock_shared_nodes();
-
-      thread_roots.push_back(_make_tree(indices, true, _random, threaded_build_policy));
+  uint64_t get_query_path(const T* w) const {
+    uint64_t path = 0;
+    if (get_n_trees() == 0)
+      return path;
+    T w_sum = 0;
+    for (int z = 0; z < _f; z++)
+      w_sum += w[z];
+    S i = _roots[0];
+    for (int bit = 63; bit >= 0 && i >= _n_items; bit--) {
+      const AnnoyQuantizedNode* nd = _node(i);
+      if (nd->n_descendants <= _header->K)
+        break;
+      const AnnoyQuantizedPlane<C>* plane = _plane(nd);
+      bool side = plane->bias + plane->offset * w_sum + plane->scale * AnnoyCodec<C>::dot(w, plane->codes, _f) > 0;
+      path |= (uint64_t)side << bit;
+      i = nd->children[side];
     }
-
-    threaded_build_policy.lock_roots();
-    _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
-    threaded_build_policy.unlock_roots();
+    return path;
   }
 
-protected:
-  void _reallocate_nodes(S n) {
-    const double reallocation_factor = 1.3;
-    S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
-    void *old = _nodes;
-    
-    if (_on_disk) {
-      if (!remap_memory_and_truncate(&_nodes, _fd, 
-          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size), 
-          static_cast<size_t>(_s) * static_cast<size_t>(new_nodes_size)) && 
-          _verbose)
-          annoylib_showUpdate("File truncation error\n");
-    } else {
-      _nodes = realloc(_nodes, _s * new_nodes_size);
-      memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
-    }
-    
-    _nodes_size = new_nodes_size;
-    if (_verbose) annoylib_showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
+  const AnnoyIndexStats& get_stats() const {
+    return _stats;
   }
 
-  void _allocate_size(S n, ThreadedBuildPolicy& threaded_build_policy) {
-    if (n > _nodes_size) {
-      threaded_build_policy.lock_nodes();
-      _reallocate_nodes(n);
-      threaded_build_policy.unlock_nodes();
-    }
+  // Nodes are in the order of the index this was saved from, not recorded.
+  AnnoyLayout get_layout() const {
+    return ANNOYLIB_LAYOUT_BUILD;
   }
 
-  void _allocate_size(S n) {
-    if (n > _nodes_size) {
-      _reallocate_nodes(n);
-    }
+  // A quantized index is only ever loaded, once.
+  uint64_t get_generation() const {
+    return 0;
   }
 
-  Node* _get(const S i) const {
-    return get_node_ptr<S, Node>(_nodes, _s, i);
+  S get_n_items() const {
+    return _n_items;
   }
 
-  double _split_imbalance(const vector<S>& left_indices, const vector<S>& right_indices) {
-    double ls = (float)left_indices.size();
-    double rs = (float)right_indices.size();
-    float f = ls / (ls + rs + 1e-9);  // Avoid 0/0
-    return std::max(f, 1-f);
+  S get_n_trees() const {
+    return _header ? _header->n_roots : 0;
   }
 
-  S _make_tree(const vector<S>& indices, bool is_root, Random& _random, ThreadedBuildPolicy& threaded_build_policy) {
-    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
-    // There's some regrettable complications caused by the problem that root nodes have to be "special":
-    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
-    // 2. Root nodes with only 1 child need to be a "dummy" parent
-    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
-    if (indices.size() == 1 && !is_root)
-      return indices[0];
-
-    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
-      threaded_build_policy.lock_n_nodes();
-      _allocate_size(_n_nodes + 1, threaded_build_policy);
-      S item = _n_nodes++;
-      threaded_build_policy.unlock_n_nodes();
-
-      threaded_build_policy.lock_shared_nodes();
-      Node* m = _get(item);
-      m->n_descendants = is_root ? _n_items : (S)indices.size();
-
-      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
-      // probably because gcc 4.8 goes overboard with optimizations.
-      // Using memcpy instead of std::copy for MSVC compatibility. #235
-      // Only copy when necessary to avoid crash in MSVC 9. #293
-      if (!indices.empty())
-        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+  void verbose(bool v) {
+    _verbose = v;
+  }
 
-      threaded_build_policy.unlock_shared_nodes();
-      return item;
+  void get_item(S item, T* v) const {
+    if (_vectors) {
+      memcpy(v, (const T*)_vectors + (size_t)item * _f, _f * sizeof(T));
+      return;
     }
-
-    threaded_build_policy.lock_shared_nodes();
-    vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n)
-        children.push_back(n);
+    if (_subvectors) {
+      const uint8_t* codes = _pq_codes(item);
+      int d = _f / _subvectors;
+      for (int j = 0; j < _subvectors; j++)
+        memcpy(v + j * d, _codebook + ((size_t)j * ANNOYLIB_PQ_CENTROIDS + codes[j]) * d, d * sizeof(T));
+      return;
     }
+    const AnnoyQuantizedItem<C>* x = _item(item);
+    for (int z = 0; z < _f; z++)
+      v[z] = x->offset + x->scale * AnnoyCodec<C>::decode(x->codes[z]);
+  }
 
-    vector<S> children_indices[2];
-    Node* m = (Node*)alloca(_s);
-
-    for (int attempt = 0; attempt < 3; attempt++) {
-      children_indices[0].clear();
-      children_indices[1].clear();
-      D::create_split(children, _f, _s, _random, m);
+  void set_seed(uint64_t seed) {
+  }
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        Node* n = _get(j);
-        if (n) {
-          bool side = D::side(m, n->v, _f, _random);
-          children_indices[side].push_back(j);
-        } else {
-          annoylib_showUpdate("No node for index %d?\n", j);
-        }
-      }
+protected:
+  bool _read_only(char** error) const {
+    set_error_from_string(error, "You can't change a quantized index");
+    return false;
+  }
 
-      if (_split_imbalance(children_indices[0], children_indices[1]) < 0.95)
-        break;
+  static void* _map(const char* filename, bool prefault, size_t* size, char** error) {
+    int fd = open(filename, O_RDONLY, (int)0400);
+    if (fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      return NULL;
+    }
+    off_t n = lseek_getsize(fd);
+    if (n <= 0) {
+      set_error_from_errno(error, n == 0 ? "Size of file is zero" : "Unable to get size");
+      close(fd);
+      return NULL;
     }
-    threaded_build_policy.unlock_shared_nodes();
 
-    // If we didn't find a hyperplane, just randomize sides as a last option
-    while (_split_imbalance(children_indices[0], children_indices[1]) > 0.99) {
-      if (_verbose)
-        annoylib_showUpdate("\tNo hyperplane found (left has %ld children, right has %ld children)\n",
-          children_indices[0].size(), children_indices[1].size());
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefault)
+      flags |= MAP_POPULATE;
+#endif
+    void* data = mmap(0, n, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      set_error_from_errno(error, "Unable to map");
+      return NULL;
+    }
+    *size = n;
+    return data;
+  }
 
-      children_indices[0].clear();
-      children_indices[1].clear();
+  const AnnoyQuantizedItem<C>* _item(S i) const {
+    return (const AnnoyQuantizedItem<C>*)(_items + _item_size * i);
+  }
 
-      // Set the vector to 0.0
-      for (int z = 0; z < _f; z++)
-        m->v[z] = 0;
+  const AnnoyQuantizedNode* _node(S i) const {
+    return _nodes + (i - _n_items);
+  }
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        // Just randomize...
-        children_indices[_random.flip()].push_back(j);
-      }
-    }
+  void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    AnnoyQueryState<S, T>* state = AnnoyQueryContext<S, T>::local().reuse_whole();
+    _query_begin(state, v, n, search_k);
+    _query_advance(state, numeric_limits<size_t>::max());
+    _query_finish(state, result, distances);
+  }
 
-    int flip = (children_indices[0].size() > children_indices[1].size());
+  const uint8_t* _pq_codes(S i) const {
+    return (const uint8_t*)_items + (size_t)i * _subvectors;
+  }
 
-    m->n_descendants = is_root ? _n_items : (S)indices.size();
-    for (int side = 0; side < 2; side++) {
-      // run _make_tree for the smallest child first (for cache locality)
-      m->children[side^flip] = _make_tree(children_indices[side^flip], false, _random, threaded_build_policy);
+  // the distance between the query of state and a product quantized item.
+  T _pq_distance(const AnnoyQueryState<S, T>* state, T q_norm, S i) const {
+    const uint8_t* codes = _pq_codes(i);
+    const T* table = &state->table[0];
+    T sum = 0, x_norm = 0;
+    for (int j = 0; j < _subvectors; j++) {
+      size_t c = (size_t)j * ANNOYLIB_PQ_CENTROIDS + codes[j];
+      sum += table[c];
+      x_norm += _centroid_norms[c];
     }
+    return PQDistance<D>::distance(sum, q_norm, x_norm);
+  }
 
-    threaded_build_policy.lock_n_nodes();
-    _allocate_size(_n_nodes + 1, threaded_build_policy);
-    S item = _n_nodes++;
-    threaded_build_policy.unlock_n_nodes();
-
-    threaded_build_policy.lock_shared_nodes();
-    memcpy(_get(item), m, _s);
-    threaded_build_policy.unlock_shared_nodes();
+  const AnnoyQuantizedPlane<C>* _plane(const AnnoyQuantizedNode* nd) const {
+    return (const AnnoyQuantizedPlane<C>*)(_planes + _plane_size * nd->plane);
+  }
 
-    return item;
+  // item i as a float node, from the float vectors if loaded.
+  void _get_node(S i, Node* n) const {
+    D::template zero_value<Node>(n);
+    get_item(i, n->v);
+    D::init_node(n, _f);
   }
 
-  void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
-    Node* v_node = (Node *)alloca(_s);
+  void _query_begin(AnnoyQueryState<S, T>* state, const T* v, size_t n, int search_k) const {
+    state->query.resize(_s);
+    Node* v_node = (Node *)&state->query[0];
     D::template zero_value<Node>(v_node);
     memcpy(v_node->v, v, sizeof(T) * _f);
     D::init_node(v_node, _f);
 
-    std::priority_queue<pair<T, S> > q;
+    if (_subvectors) {
+      // the query's partial distance to every centroid.
+      int d = _f / _subvectors;
+      state->table.resize(ANNOYLIB_PQ_CENTROIDS * _subvectors);
+      for (int j = 0; j < _subvectors; j++)
+        for (int c = 0; c < ANNOYLIB_PQ_CENTROIDS; c++)
+          state->table[j * ANNOYLIB_PQ_CENTROIDS + c] =
+            PQDistance<D>::partial(v + j * d, _codebook + ((size_t)j * ANNOYLIB_PQ_CENTROIDS + c) * d, d);
+    }
 
+    S n_roots = get_n_trees();
     if (search_k == -1) {
-      search_k = n * _roots.size();
+      search_k = n * n_roots;
     }
 
-    for (size_t i = 0; i < _roots.size(); i++) {
-      q.push(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+    state->phase = AnnoyQueryState<S, T>::TRAVERSE;
+    state->n = n;
+    state->search_k = (size_t)search_k;
+    state->q.clear();
+    state->begin_candidates(_n_items);
+    state->nns_dist.clear();
+    state->scored = 0;
+    // enough to rerank, if reranking.
+    state->keep = _vectors && _rerank_factor > 0 ? n * _rerank_factor : n;
+    state->started = std::chrono::steady_clock::now();
+
+    for (S i = 0; i < n_roots; i++) {
+      state->q.push_back(make_pair(D::template pq_initial_value<T>(), _roots[i]));
     }
+    std::make_heap(state->q.begin(), state->q.end());
+  }
 
-    std::vector<S> nns;
-    while (nns.size() < (size_t)search_k && !q.empty()) {
-      const pair<T, S>& top = q.top();
-      T d = top.first;
-      S i = top.second;
-      Node* nd = _get(i);
-      q.pop();
-      if (nd->n_descendants == 1 && i < _n_items) {
-        nns.push_back(i);
-      } else if (nd->n_descendants <= _K) {
-        const S* dst = nd->children;
-        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+  bool _query_advance(AnnoyQueryState<S, T>* state, size_t max_steps) const {
+    const T* v = ((const Node *)&state->query[0])->v;
+    vector<pair<T, S> >& q = state->q;
+    vector<S>& nns = state->nns;
+    uint64_t visited = 0, evaluated = 0, duplicates = 0;
+    T q_sum = 0;
+    for (int z = 0; z < _f; z++)
+      q_sum += v[z];
+    T q_norm = dot(v, v, _f);
+
+    for (; max_steps > 0; max_steps--) {
+      if (state->phase == AnnoyQueryState<S, T>::TRAVERSE) {
+        if (state->found >= state->search_k || q.empty()) {
+          state->phase = AnnoyQueryState<S, T>::SCORE;
+          continue;
+        }
+
+        std::pop_heap(q.begin(), q.end());
+        T d = q.back().first;
+        S i = q.back().second;
+        q.pop_back();
+        visited++;
+        if (i < _n_items) {
+          if (state->passes(i) && !state->add_candidate(i))
+            duplicates++;
+          continue;
+        }
+        const AnnoyQuantizedNode* nd = _node(i);
+        if (nd->n_descendants <= _header->K) {
+          const S* dst = _children + nd->children[0];
+          for (S k = 0; k < nd->n_descendants; k++)
+            if (state->passes(dst[k]) && !state->add_candidate(dst[k]))
+              duplicates++;
+        } else {
+          const AnnoyQuantizedPlane<C>* plane = _plane(nd);
+          T margin = plane->bias + plane->offset * q_sum + plane->scale * AnnoyCodec<C>::dot(v, plane->codes, _f);
+          q.push_back(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
+          std::push_heap(q.begin(), q.end());
+          q.push_back(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
+          std::push_heap(q.begin(), q.end());
+        }
+      } else if (state->phase == AnnoyQueryState<S, T>::SCORE) {
+        if (state->scored == nns.size()) {
+          state->phase = AnnoyQueryState<S, T>::DONE;
+          break;
+        }
+
+        S j = nns[state->scored++];
+        if (_subvectors) {
+          state->offer(_pq_distance(state, q_norm, j), j);
+          evaluated++;
+          continue;
+        }
+        const AnnoyQuantizedItem<C>* x = _item(j);
+        if (x->norm >= 0) {
+          state->offer(QuantizedDistance<D, C>::distance(v, q_sum, q_norm, x, _f), j);
+          evaluated++;
+        }
       } else {
-        T margin = D::margin(nd, v, _f);
-        q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
-        q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
+        break;
       }
     }
 
-    // Get distances for all items
-    // To avoid calculating distance multiple times for any items, sort by id
-    std::sort(nns.begin(), nns.end());
-    vector<pair<T, S> > nns_dist;
-    S last = -1;
-    for (size_t i = 0; i < nns.size(); i++) {
-      S j = nns[i]; 
-      if (j == last)
-        continue;
-      last = j;
-      if (_get(j)->n_descendants == 1)  // This is only to guard a really obscure case, #284
-        nns_dist.push_back(make_pair(D::distance(v_node, _get(j), _f), j));
-    }
+    AnnoyIndexStats::add(_stats.visited_nodes, visited);
+    AnnoyIndexStats::add(_stats.distance_evaluations, evaluated);
+    AnnoyIndexStats::add(_stats.duplicates, duplicates);
+    return state->phase == AnnoyQueryState<S, T>::DONE;
+  }
 
+  void _query_finish(AnnoyQueryState<S, T>* state, vector<S>* result, vector<T>* distances) const {
+    vector<pair<T, S> >& nns_dist = state->nns_dist;
     size_t m = nns_dist.size();
-    size_t p = n < m ? n : m; // Return this many items
-    std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
+
+    if (_vectors && _rerank_factor > 0) {
+      // score the closest candidates again, on their float vectors.
+      const Node* v_node = (const Node *)&state->query[0];
+      Node* x = (Node*)alloca(_s);
+      for (size_t i = 0; i < m; i++) {
+        _get_node(nns_dist[i].second, x);
+        nns_dist[i].first = D::distance(v_node, x, _f);
+      }
+    }
+
+    size_t p = state->n < m ? state->n : m; // Return this many items
+    std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.begin() + m);
     for (size_t i = 0; i < p; i++) {
       if (distances)
         distances->push_back(D::normalized_distance(nns_dist[i].first));
       result->push_back(nns_dist[i].second);
     }
-  }
-};
-
-class AnnoyIndexSingleThreadedBuildPolicy {
-public:
-  template<typename S, typename T, typename D, typename Random>
-  static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, int q, int n_threads) {
-    AnnoyIndexSingleThreadedBuildPolicy threaded_build_policy;
-    annoy->thread_build(q, 0, threaded_build_policy);
-  }
-
-  void lock_n_nodes() {}
-  void unlock_n_nodes() {}
-
-  void lock_nodes() {}
-  void unlock_nodes() {}
-
-  void lock_shared_nodes() {}
-  void unlock_shared_nodes() {}
-
-  void lock_roots() {}
-  void unlock_roots() {}
-};
-
-#ifdef ANNOYLIB_MULTITHREADED_BUILD
-class AnnoyIndexMultiThreadedBuildPolicy {
-private:
-  std::shared_timed_mutex nodes_mutex;
-  std::mutex n_nodes_mutex;
-  std::mutex roots_mutex;
-
-public:
-  template<typename S, typename T, typename D, typename Random>
-  static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, int q, int n_threads) {
-    AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy;
-    if (n_threads == -1) {
-      // If the hardware_concurrency() value is not well defined or not computable, it returns 0.
-      // We guard against this by using at least 1 thread.
-      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
-    }
-
-    vector<std::thread> threads(n_threads);
-
-    for (int thread_idx = 0; thread_idx < n_threads; thread_idx++) {
-      int trees_per_thread = q == -1 ? -1 : (int)floor((q + thread_idx) / n_threads);
-
-      threads[thread_idx] = std::thread(
-        &AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>::thread_build,
-        annoy,
-        trees_per_thread,
-        thread_idx,
-        std::ref(threaded_build_policy)
-      );
-    }
-
-    for (auto& thread : threads) {
-      thread.join();
-    }
-  }
-
-  void lock_n_nodes() {
-    n_nodes_mutex.lock();
-  }
-  void unlock_n_nodes() {
-    n_nodes_mutex.unlock();
-  }
 
-  void lock_nodes() {
-    nodes_mutex.lock();
-  }
-  void unlock_nodes() {
-    nodes_mutex.unlock();
-  }
-
-  void lock_shared_nodes() {
-    nodes_mutex.lock_shared();
-  }
-  void unlock_shared_nodes() {
-    nodes_mutex.unlock_shared();
-  }
-
-  void lock_roots() {
-    roots_mutex.lock();
-  }
-  void unlock_roots() {
-    roots_mutex.unlock();
+    AnnoyIndexStats::add(_stats.queries, 1);
+    _stats.add_latency(AnnoyIndexStats::elapsed_us(state->started));
   }
 };
-#endif
 
 }
 
@@ -239,4 +239,22 @@ inline int ftruncate(const int fd, const int64_t size) {
 }
 #endif
 
+// Writes count bytes at offset, leaving the file pointer alone, so threads can
+// write to different parts of a file at once.
+inline int64_t pwrite(const int fd, const void *buf, size_t count, int64_t offset) {
+    HANDLE h = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+    OVERLAPPED o = {};
+    DWORD written;
+
+    o.Offset = static_cast<DWORD>(offset);
+    o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    if (count > 0x40000000)
+        count = 0x40000000;
+    if (!WriteFile(h, buf, static_cast<DWORD>(count), &written, &o)) {
+        errno = __map_mman_error(GetLastError(), EIO);
+        return -1;
+    }
+    return written;
+}
+
 #endif 
@@ -0,0 +1,42 @@
+defmodule AnnoyExAddItemsTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  test "add_items/4 with consecutive ids matches add_item/3" do
+    f = 10
+    rows = Enum.map(1..2000, fn _ -> normal_list(f) end)
+
+    a = AnnoyEx.new(f, :angular)
+    Enum.with_index(rows, fn v, j -> AnnoyEx.add_item(a, j, v) end)
+
+    b = AnnoyEx.new(f, :angular)
+    assert AnnoyEx.add_items(b, 0, to_f32(rows)) == :ok
+    assert AnnoyEx.get_n_items(b) == 2000
+
+    AnnoyEx.set_seed(a, 7)
+    AnnoyEx.set_seed(b, 7)
+    AnnoyEx.build(a, 10)
+    AnnoyEx.build(b, 10)
+
+    for j <- 0..99 do
+      assert AnnoyEx.get_nns_by_item(a, j, 10) == AnnoyEx.get_nns_by_item(b, j, 10)
+    end
+  end
+
+  test "add_items/4 with explicit ids" do
+    i = AnnoyEx.new(2, :euclidean)
+    assert AnnoyEx.add_items(i, to_i32([5, 1, 3]), to_f32([[5, 5], [1, 1], [3, 3]]), 1) == :ok
+    assert AnnoyEx.get_n_items(i) == 6
+    assert AnnoyEx.get_item_vector(i, 3) == [3.0, 3.0]
+
+    AnnoyEx.build(i, 10)
+    assert {[1, 3, 5], _} = AnnoyEx.get_nns_by_vector(i, [0, 0], 3)
+  end
+
+  test "add_items/4 rejects malformed input" do
+    i = AnnoyEx.new(2)
+    assert_raise ArgumentError, fn -> AnnoyEx.add_items(i, 0, <<1, 2, 3>>) end
+    assert_raise ArgumentError, fn -> AnnoyEx.add_items(i, to_i32([0]), to_f32([[1, 1], [2, 2]])) end
+    assert_raise ArgumentError, fn -> AnnoyEx.add_items(i, -1, to_f32([[1, 1]])) end
+  end
+end
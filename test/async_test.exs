@@ -0,0 +1,34 @@
+defmodule AnnoyExAsyncTest do
+  use ExUnit.Case, async: true
+
+  test "build_async/3 then save_async/3 and load_async/3" do
+    f = 10
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..999 do
+      AnnoyEx.add_item(i, j, AnnoyTestHelper.normal_list(f))
+    end
+
+    ref = AnnoyEx.build_async(i, 10)
+    assert is_reference(ref)
+    assert_receive {^ref, :ok}, 10_000
+    assert AnnoyEx.get_n_trees(i) == 10
+
+    ref = AnnoyEx.save_async(i, filename())
+    assert AnnoyEx.await(ref) == :ok
+
+    j = AnnoyEx.new(f, :euclidean)
+    ref = AnnoyEx.load_async(j, filename())
+    assert AnnoyEx.await(ref, 10_000) == :ok
+    assert AnnoyEx.get_n_items(j) == 1000
+    assert AnnoyEx.get_nns_by_item(j, 0, 10) == AnnoyEx.get_nns_by_item(i, 0, 10)
+  end
+
+  test "async errors are delivered as messages" do
+    i = AnnoyEx.new(3)
+    ref = AnnoyEx.load_async(i, Path.join(System.tmp_dir!(), "does_not_exist.ann"))
+    assert {:err, _} = AnnoyEx.await(ref)
+  end
+
+  defp filename(), do: Path.join(System.tmp_dir!(), "async.ann")
+end
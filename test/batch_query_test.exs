@@ -0,0 +1,71 @@
+defmodule AnnoyExBatchQueryTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  test "get_nns_by_vectors/5 matches get_nns_by_vector/5" do
+    f = 10
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..999 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+
+    queries = Enum.map(1..300, fn _ -> normal_list(f) end)
+    results = AnnoyEx.get_nns_by_vectors(i, to_f32(queries), 10, -1, n_threads: 4)
+    assert length(results) == 300
+
+    for {q, {ids, dists}} <- Enum.zip(queries, results) do
+      {expected_ids, expected_dists} = AnnoyEx.get_nns_by_vector(i, to_f32([q]), 10)
+      assert from_i32(ids) == expected_ids
+
+      for {d, e} <- Enum.zip(from_f32(dists), expected_dists) do
+        assert_in_delta(d, e, 1.0e-6)
+      end
+    end
+  end
+
+  @tag :tmp_dir
+  test "get_nns_by_vectors/5 gives the same results for every metric", %{tmp_dir: tmp_dir} do
+    f = 16
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = AnnoyEx.new(f, metric)
+
+      for j <- 0..1999 do
+        AnnoyEx.add_item(i, j, normal_list(f))
+      end
+
+      AnnoyEx.build(i, 10)
+      file = Path.join(tmp_dir, "#{metric}.q8")
+      assert :ok == AnnoyEx.save_quantized(i, file)
+      q = AnnoyEx.new(f, metric)
+      assert :ok == AnnoyEx.load_quantized(q, file)
+
+      queries = Enum.map(1..37, fn _ -> normal_list(f) end)
+
+      for idx <- [i, q], search_k <- [-1, 50, 5000] do
+        results = AnnoyEx.get_nns_by_vectors(idx, to_f32(queries), 10, search_k, format: :list)
+
+        assert results ==
+                 for(v <- queries, do: AnnoyEx.get_nns_by_vector(idx, v, 10, search_k))
+      end
+    end
+  end
+
+  test "get_nns_by_vectors/5 options" do
+    i = AnnoyEx.new(2, :euclidean)
+    AnnoyEx.add_item(i, 0, [0, 0])
+    AnnoyEx.add_item(i, 1, [1, 1])
+    AnnoyEx.build(i, 10)
+
+    assert [{ids, <<>>}] =
+             AnnoyEx.get_nns_by_vectors(i, to_f32([[1, 1]]), 2, -1, include_distances: false)
+
+    assert from_i32(ids) == [1, 0]
+    assert AnnoyEx.get_nns_by_vectors(i, <<>>, 2) == []
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_vectors(i, <<1, 2, 3>>, 2) end
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_vectors(i, <<>>, 2, -1, [:bad]) end
+  end
+end
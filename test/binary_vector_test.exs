@@ -0,0 +1,42 @@
+defmodule AnnoyExBinaryVectorTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  test "binary vectors give the same results as lists" do
+    f = 16
+    a = AnnoyEx.new(f, :euclidean)
+    b = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..499 do
+      v = normal_list(f)
+      assert AnnoyEx.add_item(a, j, v) == :ok
+      assert AnnoyEx.add_item(b, j, to_f32(v)) == :ok
+    end
+
+    AnnoyEx.set_seed(a, 42)
+    AnnoyEx.set_seed(b, 42)
+    AnnoyEx.build(a, 10)
+    AnnoyEx.build(b, 10)
+
+    for _ <- 1..20 do
+      v = normal_list(f)
+      assert AnnoyEx.get_nns_by_vector(a, to_f32(v), 10) == AnnoyEx.get_nns_by_vector(b, v, 10)
+    end
+  end
+
+  test "unaligned binaries are accepted" do
+    a = AnnoyEx.new(3, :angular)
+    <<_::8, v::binary>> = <<0, to_f32([1.0, 0.0, 0.0])::binary>>
+    assert AnnoyEx.add_item(a, 0, v) == :ok
+    AnnoyEx.add_item(a, 1, [0, 1, 0])
+    AnnoyEx.build(a, 10)
+
+    assert {[0, 1], _} = AnnoyEx.get_nns_by_vector(a, v, 2)
+  end
+
+  test "binaries of the wrong size are rejected" do
+    a = AnnoyEx.new(3)
+    assert_raise ArgumentError, fn -> AnnoyEx.add_item(a, 0, to_f32([1.0, 2.0])) end
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_vector(a, <<1, 2, 3>>, 1) end
+  end
+end
@@ -147,4 +147,24 @@ defmodule AnnoyExDotIndexTest do
       end
     end
   end
+
+  test "preprocessing on several threads gives the same index" do
+    {n, f} = {20000, 5}
+    vectors = for j <- 0..(n - 1), do: Enum.map(normal_list(f), &(&1 * (1 + rem(j, 7))))
+
+    results =
+      for n_jobs <- [1, 4] do
+        i = AnnoyEx.new(f, :dot)
+        AnnoyEx.set_seed(i, 42)
+
+        for {v, j} <- Enum.with_index(vectors) do
+          AnnoyEx.add_item(i, j, v)
+        end
+
+        assert :ok == AnnoyEx.build(i, 3, n_jobs)
+        for(a <- 0..19, do: AnnoyEx.get_nns_by_item(i, a, 10, -1, true))
+      end
+
+    assert Enum.uniq(results) |> length() == 1
+  end
 end
@@ -0,0 +1,89 @@
+defmodule AnnoyExFilterTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp bitset(n, fun) do
+    bits = for i <- 0..(n - 1), into: <<>>, do: <<if(fun.(i), do: 1, else: 0)::1>>
+    pad = rem(8 - rem(bit_size(bits), 8), 8)
+    <<bits::bitstring, 0::size(pad)>>
+  end
+
+  defp index(f, n) do
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..(n - 1) do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    i
+  end
+
+  test "only allowed items are returned" do
+    f = 10
+    i = index(f, 1000)
+    even = fn j -> rem(j, 2) == 0 end
+    v = normal_list(f)
+
+    {res, dists} = AnnoyEx.get_nns_by_vector(i, v, 10, -1, true, allow: bitset(1000, even))
+    assert length(res) == 10
+    assert Enum.all?(res, even)
+    assert dists == Enum.sort(dists)
+
+    ids = Enum.filter(0..999, even)
+    assert AnnoyEx.get_nns_by_vector(i, v, 10, -1, true, allow: ids) == {res, dists}
+  end
+
+  test "denied items are never returned" do
+    f = 10
+    i = index(f, 1000)
+    denied = Enum.to_list(0..499)
+
+    {res, _} = AnnoyEx.get_nns_by_item(i, 0, 20, -1, true, deny: denied)
+    assert length(res) == 20
+    assert Enum.all?(res, &(&1 >= 500))
+
+    {res, _} = AnnoyEx.get_nns_by_item(i, 0, 20, -1, true, deny: bitset(500, fn _ -> true end))
+    assert Enum.all?(res, &(&1 >= 500))
+  end
+
+  test "a filter finds as many passing items as there are" do
+    f = 10
+    i = index(f, 1000)
+    allowed = [3, 141, 592, 653, 998]
+
+    {res, _} = AnnoyEx.get_nns_by_vector(i, normal_list(f), 10, -1, true, allow: allowed)
+    assert Enum.sort(res) == allowed
+
+    assert AnnoyEx.get_nns_by_vector(i, normal_list(f), 10, -1, true, allow: []) == {[], []}
+  end
+
+  test "filtered candidates are not scored" do
+    f = 10
+    i = index(f, 1000)
+
+    AnnoyEx.get_nns_by_vector(i, normal_list(f), 10, -1, true, allow: [1, 2, 3])
+    assert AnnoyEx.stats(i).distance_evaluations == 3
+  end
+
+  test "batch queries take a filter too" do
+    f = 10
+    i = index(f, 1000)
+    queries = for _ <- 1..20, do: normal_list(f)
+
+    for {ids, _} <- AnnoyEx.get_nns_by_vectors(i, to_f32(queries), 10, -1, deny: 0..899 |> Enum.to_list()) do
+      assert Enum.all?(from_i32(ids), &(&1 >= 900))
+    end
+  end
+
+  test "bad filters are rejected" do
+    i = index(10, 10)
+
+    assert_raise ArgumentError, fn ->
+      AnnoyEx.get_nns_by_item(i, 0, 5, -1, true, allow: [1], deny: [2])
+    end
+
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_item(i, 0, 5, -1, true, allow: [-1]) end
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_item(i, 0, 5, -1, true, allow: <<1::1>>) end
+  end
+end
@@ -0,0 +1,96 @@
+defmodule AnnoyExHalfPrecisionTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp build_index(f, metric, opts, vectors) do
+    i = AnnoyEx.new(f, metric, opts)
+
+    for {v, j} <- Enum.with_index(vectors) do
+      AnnoyEx.add_item(i, j, v)
+    end
+
+    AnnoyEx.build(i, 10)
+    i
+  end
+
+  @tag :tmp_dir
+  test "16 bit indexes are half the size and find the same neighbours", %{tmp_dir: tmp_dir} do
+    f = 64
+    vectors = for _ <- 1..1000, do: normal_list(f)
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = build_index(f, metric, [], vectors)
+      float_file = Path.join(tmp_dir, "#{metric}.tree")
+      assert :ok == AnnoyEx.save(i, float_file)
+
+      for dtype <- [:float16, :bfloat16] do
+        h = build_index(f, metric, [dtype: dtype], vectors)
+        file = Path.join(tmp_dir, "#{metric}_#{dtype}.tree")
+        assert :ok == AnnoyEx.save(h, file)
+        assert File.stat!(file).size * 3 < File.stat!(float_file).size * 2
+
+        loaded = AnnoyEx.new(f, metric, dtype: dtype)
+        assert :ok == AnnoyEx.load(loaded, file)
+        assert AnnoyEx.get_n_items(loaded) == 1000
+
+        for k <- 0..9 do
+          expected = Enum.at(vectors, k)
+          v = AnnoyEx.get_item_vector(loaded, k)
+          for {a, b} <- Enum.zip(v, expected), do: assert_in_delta(a, b, 0.02 * abs(b) + 1.0e-3)
+
+          {ids, _} = AnnoyEx.get_nns_by_item(loaded, k, 10, 10_000)
+          {exact, _} = AnnoyEx.get_nns_by_item(i, k, 10, 10_000)
+          assert length(ids -- exact) <= 2
+        end
+      end
+    end
+  end
+
+  @tag :tmp_dir
+  test "16 bit euclidean distances are exact for the stored vectors", %{tmp_dir: tmp_dir} do
+    f = 64
+    vectors = for _ <- 1..200, do: Enum.map(normal_list(f), &(100.0 + 0.1 * &1))
+
+    for dtype <- [:float16, :bfloat16] do
+      file = Path.join(tmp_dir, "#{dtype}.tree")
+      assert :ok == AnnoyEx.save(build_index(f, :euclidean, [dtype: dtype], vectors), file)
+      h = AnnoyEx.new(f, :euclidean, dtype: dtype)
+      assert :ok == AnnoyEx.load(h, file)
+      v = Enum.map(normal_list(f), &(100.0 + 0.1 * &1))
+      {ids, distances} = AnnoyEx.get_nns_by_vector(h, v, 10, -1)
+
+      for {id, d} <- Enum.zip(ids, distances) do
+        u = AnnoyEx.get_item_vector(h, id)
+        expected = :math.sqrt(Enum.sum(Enum.zip_with(u, v, fn a, b -> (a - b) * (a - b) end)))
+        assert_in_delta d, expected, 1.0e-3 * expected
+      end
+    end
+  end
+
+  @tag :tmp_dir
+  test "the element type is recorded in the file", %{tmp_dir: tmp_dir} do
+    f = 16
+    i = build_index(f, :angular, [dtype: :float16], for(_ <- 1..100, do: normal_list(f)))
+    file = Path.join(tmp_dir, "index.tree")
+    assert :ok == AnnoyEx.save(i, file)
+
+    assert {:err, _} = AnnoyEx.load(AnnoyEx.new(f, :angular, dtype: :bfloat16), file)
+    assert {:err, _} = AnnoyEx.load(AnnoyEx.new(f, :angular), file)
+    assert :ok == AnnoyEx.load(AnnoyEx.new(f, :angular, dtype: :float16), file)
+
+    # a saved index is loaded from its file and is then read-only.
+    assert {:err, _} = AnnoyEx.add_item(i, 100, normal_list(f))
+    copy = Path.join(tmp_dir, "copy.tree")
+    assert :ok == AnnoyEx.save(i, copy)
+    assert File.read!(copy) == File.read!(file)
+  end
+
+  @tag :tmp_dir
+  test "errors", %{tmp_dir: tmp_dir} do
+    assert_raise ArgumentError, fn -> AnnoyEx.new(10, :angular, dtype: :float8) end
+
+    i = AnnoyEx.new(10, :angular, dtype: :bfloat16)
+    assert {:err, _} = AnnoyEx.save(i, Path.join(tmp_dir, "unbuilt.tree"))
+    assert {:err, _} = AnnoyEx.on_disk_build(i, Path.join(tmp_dir, "on_disk.tree"))
+  end
+end
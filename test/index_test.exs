@@ -111,6 +111,12 @@ defmodule AnnoyExIndexTest do
     assert_raise(ArgumentError, fn -> AnnoyEx.new(10, :banana) end)
   end
 
+  test "verbose takes a boolean" do
+    i = AnnoyEx.new(10, :angular)
+    assert_raise(ArgumentError, fn -> AnnoyEx.verbose(i, :maybe) end)
+    assert :ok == AnnoyEx.verbose(i, false)
+  end
+
   @tag :tmp_dir
   test "item vector after save", %{tmp_dir: tmp_dir} do
     a = AnnoyEx.new(3, :angular)
@@ -0,0 +1,61 @@
+defmodule AnnoyExLayoutTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp build_index(f, metric, n) do
+    i = AnnoyEx.new(f, metric)
+
+    for j <- 0..(n - 1) do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    i
+  end
+
+  @tag :tmp_dir
+  test "saved trees are blocked and find the same neighbours", %{tmp_dir: tmp_dir} do
+    f = 16
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = build_index(f, metric, 2000)
+      assert AnnoyEx.get_layout(i) == :build
+
+      # visiting every node leaves no room for ties between nodes to matter.
+      expected = for k <- 0..19, do: AnnoyEx.get_nns_by_item(i, k, 10, 1_000_000)
+
+      file = Path.join(tmp_dir, "#{metric}.tree")
+      assert :ok == AnnoyEx.save(i, file)
+      assert AnnoyEx.get_layout(i) == :blocked
+      assert AnnoyEx.get_n_trees(i) == 10
+
+      j = AnnoyEx.new(f, metric)
+      assert :ok == AnnoyEx.load(j, file)
+      assert AnnoyEx.get_layout(j) == :blocked
+      assert AnnoyEx.get_n_items(j) == 2000
+      assert expected == for(k <- 0..19, do: AnnoyEx.get_nns_by_item(j, k, 10, 1_000_000))
+
+      # saving a loaded index writes the same trees again.
+      copy = Path.join(tmp_dir, "#{metric}_copy.tree")
+      assert :ok == AnnoyEx.save(j, copy)
+      assert File.read!(copy) == File.read!(file)
+    end
+  end
+
+  @tag :tmp_dir
+  test "indexes built on disk keep the build order", %{tmp_dir: tmp_dir} do
+    f = 8
+    i = AnnoyEx.new(f, :angular)
+    file = Path.join(tmp_dir, "on_disk.tree")
+    assert :ok == AnnoyEx.on_disk_build(i, file)
+
+    for j <- 0..499 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 5)
+    j = AnnoyEx.new(f, :angular)
+    assert :ok == AnnoyEx.load(j, file)
+    assert AnnoyEx.get_layout(j) == :build
+  end
+end
@@ -0,0 +1,65 @@
+defmodule AnnoyExMultiQueryTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp shard(vectors) do
+    i = AnnoyEx.new(10, :euclidean)
+
+    for {v, j} <- Enum.with_index(vectors) do
+      AnnoyEx.add_item(i, j, v)
+    end
+
+    AnnoyEx.build(i, 10)
+    i
+  end
+
+  test "get_nns_multi/5 merges the shards into one top n" do
+    f = 10
+    vectors = for _ <- 1..1000, do: normal_list(f)
+    chunks = Enum.chunk_every(vectors, 250)
+    shards = Enum.map(chunks, &shard/1)
+    offsets = [0, 250, 500, 750]
+    whole = shard(vectors)
+
+    v = normal_list(f)
+    # exhaustive search_k, so that every shard and the whole index find the true top n.
+    {ids, dists} = AnnoyEx.get_nns_multi(shards, v, 10, 1_000_000, offsets: offsets)
+    {expected_ids, expected_dists} = AnnoyEx.get_nns_by_vector(whole, v, 10, 1_000_000)
+
+    assert ids == expected_ids
+
+    for {d, e} <- Enum.zip(dists, expected_dists) do
+      assert_in_delta(d, e, 1.0e-5)
+    end
+
+    assert AnnoyEx.get_nns_multi(shards, v, 10, 1_000_000, offsets: offsets, n_threads: 1) ==
+             {ids, dists}
+
+    {packed, _} = AnnoyEx.get_nns_multi(shards, v, 10, 1_000_000, offsets: offsets, format: :packed)
+    assert from_i32(packed) == ids
+
+    assert {^ids, []} =
+             AnnoyEx.get_nns_multi(shards, v, 10, 1_000_000, offsets: offsets, include_distances: false)
+  end
+
+  test "without offsets ids are those of each shard" do
+    shards = for _ <- 1..3, do: shard(for(_ <- 1..50, do: normal_list(10)))
+    {ids, _} = AnnoyEx.get_nns_multi(shards, normal_list(10), 100)
+    assert length(ids) == 100
+    assert Enum.all?(ids, &(&1 in 0..49))
+  end
+
+  test "shards must match" do
+    a = shard([normal_list(10)])
+    b = AnnoyEx.new(10, :angular)
+    c = AnnoyEx.new(5, :euclidean)
+
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_multi([a, b], normal_list(10), 1) end
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_multi([a, c], normal_list(10), 1) end
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_multi([], normal_list(10), 1) end
+
+    assert_raise ArgumentError, fn ->
+      AnnoyEx.get_nns_multi([a, a], normal_list(10), 1, -1, offsets: [0])
+    end
+  end
+end
@@ -17,6 +17,52 @@ defmodule AnnoyExMultiThreadedBuildTest do
     test_building_with_threads(8)
   end
 
+  test "the trees do not depend on the number of threads" do
+    f = 10
+    vectors = for _ <- 0..19999, do: Enum.map(1..f, fn _ -> :rand.normal() end)
+
+    indexes =
+      for n_jobs <- [1, 3, 8] do
+        i = AnnoyEx.new(f, :angular)
+        AnnoyEx.set_seed(i, 42)
+
+        for {v, j} <- Enum.with_index(vectors) do
+          AnnoyEx.add_item(i, j, v)
+        end
+
+        assert :ok == AnnoyEx.build(i, 3, n_jobs)
+        i
+      end
+
+    # visiting every node leaves no room for ties between nodes to matter.
+    results = for i <- indexes, do: for(k <- 0..19, do: AnnoyEx.get_nns_by_item(i, k, 10, 1_000_000))
+    assert Enum.uniq(results) |> length() == 1
+  end
+
+  @tag :tmp_dir
+  test "an index built on disk is the same file for any number of threads", %{tmp_dir: tmp_dir} do
+    f = 10
+    vectors = for _ <- 0..9999, do: Enum.map(1..f, fn _ -> :rand.normal() end)
+
+    files =
+      for n_jobs <- [1, 4] do
+        file = Path.join(tmp_dir, "#{n_jobs}.ann")
+        i = AnnoyEx.new(f, :euclidean)
+        AnnoyEx.set_seed(i, 42)
+        AnnoyEx.on_disk_build(i, file)
+
+        for {v, j} <- Enum.with_index(vectors) do
+          AnnoyEx.add_item(i, j, v)
+        end
+
+        assert :ok == AnnoyEx.build(i, 5, n_jobs)
+        AnnoyEx.unload(i)
+        File.read!(file)
+      end
+
+    assert Enum.uniq(files) |> length() == 1
+  end
+
   defp test_building_with_threads(n_jobs) do
     n = 10000
     f = 10
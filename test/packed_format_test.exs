@@ -0,0 +1,44 @@
+defmodule AnnoyExPackedFormatTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  setup do
+    f = 10
+    i = AnnoyEx.new(f, :angular)
+
+    for j <- 0..999 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    {:ok, idx: i, f: f}
+  end
+
+  test "packed results carry the same items and distances", %{idx: i, f: f} do
+    {ids, dists} = AnnoyEx.get_nns_by_item(i, 0, 100)
+    {packed_ids, packed_dists} = AnnoyEx.get_nns_by_item(i, 0, 100, -1, true, format: :packed)
+
+    assert from_i32(packed_ids) == ids
+
+    for {d, e} <- Enum.zip(from_f32(packed_dists), dists) do
+      assert_in_delta(d, e, 1.0e-6)
+    end
+
+    v = normal_list(f)
+    {ids, _} = AnnoyEx.get_nns_by_vector(i, v, 10)
+    {packed_ids, _} = AnnoyEx.get_nns_by_vector(i, v, 10, -1, true, format: :packed)
+    assert from_i32(packed_ids) == ids
+  end
+
+  test "packed results without distances", %{idx: i} do
+    {ids, <<>>} = AnnoyEx.get_nns_by_item(i, 0, 10, -1, false, format: :packed)
+    assert byte_size(ids) == 40
+  end
+
+  test "list format is the default", %{idx: i} do
+    assert AnnoyEx.get_nns_by_item(i, 0, 10, -1, true, format: :list) ==
+             AnnoyEx.get_nns_by_item(i, 0, 10)
+
+    assert_raise ArgumentError, fn -> AnnoyEx.get_nns_by_item(i, 0, 10, -1, true, format: :csv) end
+  end
+end
@@ -0,0 +1,182 @@
+defmodule AnnoyExQuantizedTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp build_index(f, metric, n) do
+    i = AnnoyEx.new(f, metric)
+
+    for j <- 0..(n - 1) do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    i
+  end
+
+  defp overlap(i, q, f, queries) do
+    hits =
+      for _ <- 1..queries do
+        v = normal_list(f)
+        {expected, _} = AnnoyEx.get_nns_by_vector(i, v, 10)
+        {found, _} = AnnoyEx.get_nns_by_vector(q, v, 10)
+        MapSet.size(MapSet.intersection(MapSet.new(expected), MapSet.new(found)))
+      end
+
+    Enum.sum(hits) / (10 * queries)
+  end
+
+  @tag :tmp_dir
+  test "quantized index finds mostly the same neighbours", %{tmp_dir: tmp_dir} do
+    f = 64
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = build_index(f, metric, 1000)
+      float_file = Path.join(tmp_dir, "#{metric}.tree")
+      file = Path.join(tmp_dir, "#{metric}.q8")
+      assert :ok == AnnoyEx.save(i, float_file)
+      assert :ok == AnnoyEx.save_quantized(i, file)
+      assert File.stat!(file).size * 2 < File.stat!(float_file).size
+
+      q = AnnoyEx.new(f, metric)
+      assert :ok == AnnoyEx.load_quantized(q, file)
+      assert AnnoyEx.get_n_items(q) == 1000
+      assert AnnoyEx.get_n_trees(q) == AnnoyEx.get_n_trees(i)
+      assert overlap(i, q, f, 20) >= 0.8
+    end
+  end
+
+  @tag :tmp_dir
+  test "reranking with the float vectors gives exact distances", %{tmp_dir: tmp_dir} do
+    f = 32
+    i = build_index(f, :euclidean, 500)
+    file = Path.join(tmp_dir, "index.q8")
+    vectors = Path.join(tmp_dir, "index.f32")
+    assert :ok == AnnoyEx.save_quantized(i, file, vectors: vectors)
+
+    q = AnnoyEx.new(f, :euclidean)
+    assert :ok == AnnoyEx.load_quantized(q, file, vectors: vectors, rerank: 8)
+    assert AnnoyEx.get_item_vector(q, 7) == AnnoyEx.get_item_vector(i, 7)
+
+    v = normal_list(f)
+    {ids, distances} = AnnoyEx.get_nns_by_vector(q, v, 10)
+    assert distances == Enum.sort(distances)
+
+    for {id, d} <- Enum.zip(ids, distances) do
+      u = AnnoyEx.get_item_vector(i, id)
+      expected = :math.sqrt(Enum.sum(Enum.zip_with(u, v, fn a, b -> (a - b) * (a - b) end)))
+      assert_in_delta d, expected, 1.0e-3
+    end
+  end
+
+  @tag :tmp_dir
+  test "euclidean distances hold far from the origin", %{tmp_dir: tmp_dir} do
+    f = 64
+    near = fn -> Enum.map(normal_list(f), &(1.0e3 + 0.01 * &1)) end
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..499 do
+      AnnoyEx.add_item(i, j, near.())
+    end
+
+    AnnoyEx.build(i, 10)
+    file = Path.join(tmp_dir, "far.q8")
+    assert :ok == AnnoyEx.save_quantized(i, file)
+
+    q = AnnoyEx.new(f, :euclidean)
+    assert :ok == AnnoyEx.load_quantized(q, file)
+
+    v = near.()
+    {ids, distances} = AnnoyEx.get_nns_by_vector(q, v, 10, -1)
+
+    for {id, d} <- Enum.zip(ids, distances) do
+      u = AnnoyEx.get_item_vector(i, id)
+      expected = :math.sqrt(Enum.sum(Enum.zip_with(u, v, fn a, b -> (a - b) * (a - b) end)))
+      assert_in_delta d, expected, 0.05 * expected
+    end
+  end
+
+  @tag :tmp_dir
+  test "product quantized index with reranking", %{tmp_dir: tmp_dir} do
+    f = 32
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = build_index(f, metric, 2000)
+      float_file = Path.join(tmp_dir, "#{metric}.tree")
+      file = Path.join(tmp_dir, "#{metric}.pq")
+      vectors = Path.join(tmp_dir, "#{metric}.f32")
+      assert :ok == AnnoyEx.save(i, float_file)
+      assert :ok == AnnoyEx.save_quantized(i, file, pq: 8, vectors: vectors)
+      assert File.stat!(file).size * 2 < File.stat!(float_file).size
+
+      q = AnnoyEx.new(f, metric)
+      assert :ok == AnnoyEx.load_quantized(q, file)
+      assert AnnoyEx.get_n_items(q) == 2000
+      {ids, _} = AnnoyEx.get_nns_by_vector(q, normal_list(f), 10)
+      assert length(ids) == 10
+
+      assert :ok == AnnoyEx.load_quantized(q, file, vectors: vectors, rerank: 20)
+      assert overlap(i, q, f, 20) >= 0.8
+    end
+
+    i = build_index(f, :angular, 100)
+    assert {:err, _} = AnnoyEx.save_quantized(i, Path.join(tmp_dir, "bad.pq"), pq: 5)
+  end
+
+  @tag :tmp_dir
+  test "float32 elements keep the split layout and the same results", %{tmp_dir: tmp_dir} do
+    f = 32
+
+    for metric <- [:angular, :euclidean, :manhattan, :dot] do
+      i = build_index(f, metric, 2000)
+      float_file = Path.join(tmp_dir, "#{metric}.tree")
+      file = Path.join(tmp_dir, "#{metric}.split")
+      assert :ok == AnnoyEx.save(i, float_file)
+      assert :ok == AnnoyEx.save_quantized(i, file, dtype: :float32)
+      assert File.stat!(file).size < File.stat!(float_file).size
+
+      q = AnnoyEx.new(f, metric)
+      assert :ok == AnnoyEx.load_quantized(q, file)
+      assert AnnoyEx.get_item_vector(q, 7) == AnnoyEx.get_item_vector(i, 7)
+
+      for _ <- 1..10 do
+        v = normal_list(f)
+        assert AnnoyEx.get_nns_by_vector(q, v, 10) == AnnoyEx.get_nns_by_vector(i, v, 10)
+      end
+    end
+
+    i = build_index(f, :angular, 100)
+    assert_raise ArgumentError, fn ->
+      AnnoyEx.save_quantized(i, Path.join(tmp_dir, "bad.split"), dtype: :float64)
+    end
+  end
+
+  @tag :tmp_dir
+  test "quantized index is read-only", %{tmp_dir: tmp_dir} do
+    f = 10
+    i = build_index(f, :angular, 100)
+    file = Path.join(tmp_dir, "index.q8")
+    assert :ok == AnnoyEx.save_quantized(i, file)
+
+    q = AnnoyEx.new(f, :angular)
+    assert :ok == AnnoyEx.load_quantized(q, file)
+    assert {:err, _} = AnnoyEx.add_item(q, 100, normal_list(f))
+    assert {:err, _} = AnnoyEx.build(q, 10)
+    assert {:err, _} = AnnoyEx.save(q, Path.join(tmp_dir, "again.tree"))
+  end
+
+  @tag :tmp_dir
+  test "errors", %{tmp_dir: tmp_dir} do
+    i = AnnoyEx.new(10, :angular)
+    file = Path.join(tmp_dir, "index.q8")
+    assert {:err, _} = AnnoyEx.save_quantized(i, file)
+
+    i = build_index(10, :angular, 100)
+    assert :ok == AnnoyEx.save_quantized(i, file)
+    assert {:err, _} = AnnoyEx.load_quantized(AnnoyEx.new(12, :angular), file)
+    assert {:err, _} = AnnoyEx.load_quantized(AnnoyEx.new(10, :euclidean), file)
+    assert {:err, _} = AnnoyEx.load_quantized(i, Path.join(tmp_dir, "missing.q8"))
+    assert AnnoyEx.get_n_items(i) == 100
+
+    assert_raise ArgumentError, fn -> AnnoyEx.load_quantized(i, file, rerank: 0) end
+  end
+end
@@ -0,0 +1,104 @@
+defmodule AnnoyExSharedIndexTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp build_and_save(file, f, n) do
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..(n - 1) do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    :ok = AnnoyEx.save(i, file)
+  end
+
+  @tag :tmp_dir
+  test "handles loading the same file share it", %{tmp_dir: tmp_dir} do
+    f = 10
+    file = Path.join(tmp_dir, "a.ann")
+    build_and_save(file, f, 1000)
+
+    handles =
+      for _ <- 1..4 do
+        i = AnnoyEx.new(f, :euclidean)
+        assert AnnoyEx.load(i, file) == :ok
+        i
+      end
+
+    v = normal_list(f)
+    [first | rest] = Enum.map(handles, &AnnoyEx.get_nns_by_vector(&1, v, 10, -1, true))
+
+    for res <- rest do
+      assert res == first
+    end
+
+    # unloading one handle leaves the others working.
+    [i | others] = handles
+    AnnoyEx.unload(i)
+    assert AnnoyEx.get_n_items(i) == 0
+
+    for j <- others do
+      assert AnnoyEx.get_n_items(j) == 1000
+      assert AnnoyEx.get_nns_by_vector(j, v, 10, -1, true) == first
+    end
+  end
+
+  @tag :tmp_dir
+  test "a rewritten file is loaded afresh", %{tmp_dir: tmp_dir} do
+    f = 10
+    file = Path.join(tmp_dir, "a.ann")
+    build_and_save(file, f, 1000)
+
+    i = AnnoyEx.new(f, :euclidean)
+    assert AnnoyEx.load(i, file) == :ok
+
+    build_and_save(file, f, 2000)
+
+    j = AnnoyEx.new(f, :euclidean)
+    assert AnnoyEx.load(j, file) == :ok
+    assert AnnoyEx.get_n_items(i) == 1000
+    assert AnnoyEx.get_n_items(j) == 2000
+  end
+
+  @tag :tmp_dir
+  test "metric and dimensions are part of what is shared", %{tmp_dir: tmp_dir} do
+    f = 10
+    file = Path.join(tmp_dir, "a.ann")
+    build_and_save(file, f, 100)
+
+    i = AnnoyEx.new(f, :euclidean)
+    j = AnnoyEx.new(f, :manhattan)
+    assert AnnoyEx.load(i, file) == :ok
+    assert AnnoyEx.load(j, file) == :ok
+
+    {_, d1} = AnnoyEx.get_nns_by_item(i, 0, 2, -1, true)
+    {_, d2} = AnnoyEx.get_nns_by_item(j, 0, 2, -1, true)
+    assert d1 != d2
+  end
+
+  @tag :tmp_dir
+  test "saving a shared index leaves the other handles alone", %{tmp_dir: tmp_dir} do
+    f = 10
+    a = Path.join(tmp_dir, "a.ann")
+    b = Path.join(tmp_dir, "b.ann")
+    build_and_save(a, f, 1000)
+
+    i = AnnoyEx.new(f, :euclidean)
+    j = AnnoyEx.new(f, :euclidean)
+    assert AnnoyEx.load(i, a) == :ok
+    assert AnnoyEx.load(j, a) == :ok
+
+    v = AnnoyEx.get_item_vector(j, 5)
+    assert AnnoyEx.save(i, b) == :ok
+    assert AnnoyEx.get_item_vector(i, 5) == v
+    assert AnnoyEx.get_item_vector(j, 5) == v
+
+    k = AnnoyEx.new(f, :euclidean)
+    assert AnnoyEx.load(k, b) == :ok
+    assert AnnoyEx.get_item_vector(k, 5) == v
+
+    assert {:err, _} = AnnoyEx.on_disk_build(i, Path.join(tmp_dir, "c.ann"))
+    assert AnnoyEx.get_n_items(j) == 1000
+  end
+end
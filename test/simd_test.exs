@@ -0,0 +1,30 @@
+defmodule AnnoyExSimdTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  test "simd_isa/0 reports the kernels in use" do
+    assert AnnoyEx.simd_isa() in [:avx512f, :avx2_fma, :sse2, :avx, :none]
+  end
+
+  # every vector length, so that both the vector loop and the remainder are covered.
+  test "distances match the plain definitions" do
+    for f <- 1..40, metric <- [:euclidean, :manhattan, :dot] do
+      i = AnnoyEx.new(f, metric)
+      a = normal_list(f)
+      b = normal_list(f)
+      AnnoyEx.add_item(i, 0, a)
+      AnnoyEx.add_item(i, 1, b)
+
+      pairs = Enum.zip(a, b)
+
+      expected =
+        case metric do
+          :euclidean -> :math.sqrt(Enum.sum(for {x, y} <- pairs, do: (x - y) * (x - y)))
+          :manhattan -> Enum.sum(for {x, y} <- pairs, do: abs(x - y))
+          :dot -> Enum.sum(for {x, y} <- pairs, do: x * y)
+        end
+
+      assert_in_delta(AnnoyEx.get_distance(i, 0, 1), expected, 1.0e-3)
+    end
+  end
+end
@@ -0,0 +1,55 @@
+defmodule AnnoyExStatsTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  test "stats count build and query work" do
+    f = 10
+    i = AnnoyEx.new(f, :euclidean)
+    s = AnnoyEx.stats(i)
+    assert s.queries == 0
+    assert length(s.latency_histogram) == 32
+
+    for j <- 0..999 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    s = AnnoyEx.stats(i)
+    assert s.reallocations > 0
+    assert s.thread_build_us >= 0
+
+    for _ <- 1..5 do
+      AnnoyEx.get_nns_by_vector(i, normal_list(f), 10)
+    end
+
+    AnnoyEx.get_nns_by_item(i, 0, 10)
+    AnnoyEx.get_nns_by_vectors(i, to_f32(for _ <- 1..4, do: normal_list(f)), 10)
+
+    s = AnnoyEx.stats(i)
+    assert s.queries == 10
+    assert Enum.sum(s.latency_histogram) == 10
+    assert s.visited_nodes > 0
+    assert s.distance_evaluations >= 10 * 10
+    assert s.duplicates >= 0
+  end
+
+  @tag :tmp_dir
+  test "loading starts from zero", %{tmp_dir: tmp_dir} do
+    f = 10
+    file = Path.join(tmp_dir, "a.ann")
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..99 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    AnnoyEx.get_nns_by_item(i, 0, 10)
+    assert AnnoyEx.stats(i).queries == 1
+
+    j = AnnoyEx.new(f, :euclidean)
+    AnnoyEx.save(i, file)
+    assert AnnoyEx.load(j, file) == :ok
+    assert AnnoyEx.stats(j).queries == 0
+  end
+end
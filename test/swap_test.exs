@@ -0,0 +1,58 @@
+defmodule AnnoyExSwapTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  defp build_and_save(file, f, n) do
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..(n - 1) do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 10)
+    :ok = AnnoyEx.save(i, file)
+  end
+
+  @tag :tmp_dir
+  test "swap/3 replaces the index under running queries", %{tmp_dir: tmp_dir} do
+    f = 10
+    a = Path.join(tmp_dir, "a.ann")
+    b = Path.join(tmp_dir, "b.ann")
+    build_and_save(a, f, 1000)
+    build_and_save(b, f, 2000)
+
+    i = AnnoyEx.new(f, :euclidean)
+    assert AnnoyEx.load(i, a) == :ok
+
+    readers =
+      for _ <- 1..4 do
+        Task.async(fn ->
+          for _ <- 1..200 do
+            {res, _} = AnnoyEx.get_nns_by_vector(i, normal_list(f), 10, 999_999_999)
+            assert length(res) == 10
+          end
+        end)
+      end
+
+    for k <- 1..20 do
+      assert AnnoyEx.swap(i, if(rem(k, 2) == 0, do: a, else: b)) == :ok
+    end
+
+    Enum.each(readers, &Task.await(&1, 60_000))
+    assert AnnoyEx.get_n_items(i) == 1000
+  end
+
+  @tag :tmp_dir
+  test "a failed swap keeps the old index", %{tmp_dir: tmp_dir} do
+    a = Path.join(tmp_dir, "a.ann")
+    build_and_save(a, 5, 100)
+
+    i = AnnoyEx.new(5, :euclidean)
+    assert AnnoyEx.load(i, a) == :ok
+    assert {:err, _} = AnnoyEx.swap(i, Path.join(tmp_dir, "missing.ann"))
+    assert AnnoyEx.get_n_items(i) == 100
+
+    assert AnnoyEx.unload(i) == :ok
+    assert AnnoyEx.get_n_items(i) == 0
+  end
+end
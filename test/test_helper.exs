@@ -6,6 +6,12 @@ defmodule AnnoyTestHelper do
     Enum.map(0..last, fn _ -> :rand.normal(0, 1) end)
   end
 
+  # a vector, or rows of them, as a binary of native-endian float32s.
+  def to_f32(rows), do: for(x <- List.flatten(rows), into: <<>>, do: <<x::float-32-native>>)
+  def to_i32(ids), do: for(i <- ids, into: <<>>, do: <<i::signed-32-native>>)
+  def from_i32(bin), do: for(<<i::signed-32-native <- bin>>, do: i)
+  def from_f32(bin), do: for(<<x::float-32-native <- bin>>, do: x)
+
   def random_gauss(mu \\ 0, sigma \\ 1) do
     {n, _next} = Random.gauss(mu, sigma)
     n
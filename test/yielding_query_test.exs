@@ -0,0 +1,114 @@
+defmodule AnnoyExYieldingQueryTest do
+  use ExUnit.Case, async: true
+  import AnnoyTestHelper
+
+  setup_all do
+    f = 20
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..19_999 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 50)
+    {:ok, idx: i, f: f}
+  end
+
+  test "a query with a huge search_k visits every item", %{idx: i} do
+    {res, dists} = AnnoyEx.get_nns_by_item(i, 0, 20_000, 999_999_999)
+    assert length(res) == 20_000
+    assert Enum.sort(res) == Enum.to_list(0..19_999)
+    assert dists == Enum.sort(dists)
+  end
+
+  test "long queries from many processes", %{idx: i, f: f} do
+    v = normal_list(f)
+    expected = AnnoyEx.get_nns_by_vector(i, v, 100, 999_999_999)
+
+    1..8
+    |> Enum.map(fn _ ->
+      Task.async(fn -> AnnoyEx.get_nns_by_vector(i, v, 100, 999_999_999) end)
+    end)
+    |> Enum.each(fn task -> assert Task.await(task, 60_000) == expected end)
+  end
+
+  test "long queries can return packed results", %{idx: i} do
+    {ids, _} = AnnoyEx.get_nns_by_item(i, 0, 20_000, 999_999_999)
+    {packed, _} = AnnoyEx.get_nns_by_item(i, 0, 20_000, 999_999_999, true, format: :packed)
+    assert from_i32(packed) == ids
+  end
+
+  test "a suspended query survives the index being rebuilt", %{f: f} do
+    i = AnnoyEx.new(f, :euclidean)
+
+    for j <- 0..9_999 do
+      AnnoyEx.add_item(i, j, normal_list(f))
+    end
+
+    AnnoyEx.build(i, 20)
+
+    queries =
+      for _ <- 1..4 do
+        Task.async(fn ->
+          for _ <- 1..5, do: AnnoyEx.get_nns_by_item(i, 0, 100, 999_999_999)
+        end)
+      end
+
+    # items past the old count, while the queries yield between slices.
+    for round <- 1..5 do
+      assert :ok == AnnoyEx.unbuild(i)
+
+      for j <- 0..999 do
+        AnnoyEx.add_item(i, 10_000 * round + j, normal_list(f))
+      end
+
+      assert :ok == AnnoyEx.build(i, 20)
+    end
+
+    n_items = AnnoyEx.get_n_items(i)
+
+    for task <- queries, {ids, dists} <- Task.await(task, 60_000) do
+      assert Enum.all?(ids, &(&1 >= 0 and &1 < n_items))
+      assert dists == Enum.sort(dists)
+    end
+  end
+
+  @tag :tmp_dir
+  test "queries arriving during a build leave the dirty IO schedulers free", %{tmp_dir: tmp_dir} do
+    f = 32
+    n = 30_000
+    i = AnnoyEx.new(f, :euclidean)
+    AnnoyEx.add_items(i, 0, to_f32(for _ <- 1..n, do: normal_list(f)))
+
+    other = AnnoyEx.new(f, :euclidean)
+    AnnoyEx.add_item(other, 0, normal_list(f))
+    AnnoyEx.build(other, 1)
+
+    parent = self()
+
+    build =
+      Task.async(fn ->
+        assert :ok == AnnoyEx.build(i, 100, 1)
+        send(parent, {:built, System.monotonic_time()})
+      end)
+
+    # more waiting queries than there are dirty IO schedulers.
+    queries =
+      for _ <- 1..(:erlang.system_info(:dirty_io_schedulers) + 4) do
+        Task.async(fn -> AnnoyEx.get_nns_by_item(i, 0, 10) end)
+      end
+
+    Process.sleep(50)
+    assert :ok == AnnoyEx.save(other, Path.join(tmp_dir, "other.ann"))
+    saved = System.monotonic_time()
+
+    Task.await(build, 120_000)
+    assert_received {:built, built}
+    assert saved < built
+
+    for task <- queries do
+      {ids, _} = Task.await(task, 60_000)
+      assert hd(ids) == 0
+    end
+  end
+end